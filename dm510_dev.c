@@ -5,51 +5,894 @@
 #include <linux/uaccess.h>
 #include <linux/wait.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/log2.h>
 #include <linux/semaphore.h>
+#include <linux/mutex.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/percpu.h>
+#include <linux/refcount.h>
+#include <linux/cpumask.h>
+#include <linux/list.h>
+#include <linux/shrinker.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/sched/signal.h>
+#include <linux/file.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/security.h>
+#include <linux/fsnotify.h>
 #include <linux/module.h>
 #include "ioctl_commands.h"
 
+// The ring counters are u64 and go through smp_load_acquire()/smp_store_release(), which
+// only take native words, and user space moves them with plain 64-bit accesses through the
+// mapped control page. So the module needs a 64-bit kernel, like x86_64 UML.
+#ifndef CONFIG_64BIT
+#error "dm510 needs a 64-bit kernel"
+#endif
+
 #define DEVICE_NAME "dm510_dev"
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 1024 // Sizes are powers of two
+#define BUFFER_SIZE_MAX (1 << 30) // Largest power of two SET_BUFFER_SIZE can express in an int
 #define MINOR_START 0
 #define DEVICE_COUNT 2
 #define DM510_IOC_MAGIC 'k'
 #define DM510_IOCRESET _IO(DM510_IOC_MAGIC, 0)
 #define DM510_IOCSQUANTUM _IOW(DM510_IOC_MAGIC, 1, int)
+#define ELASTIC_SPARES 8 // Drained pages an elastic buffer keeps around for the next burst
+#define DIRECT_PAGES 16  // Most user pages a parked reader offers the writer
+#define RESIDENCY_STAMPS 256 // Writes a buffer timestamps for SET_RESIDENCY_TRACKING before they get merged
 
 static int dm510_major = 0;
 module_param(dm510_major, int, S_IRUGO);
 
-struct buffer {
+// Upper bound for SET_BUFFER_SIZE64, raise it for rings above 1 GB
+static unsigned long max_buffer_size = 1UL << 30;
+module_param(max_buffer_size, ulong, S_IRUGO | S_IWUSR);
+
+// Time sleeps, waits for sem and copies into the per device latency histograms
+static bool latency_hist = true;
+module_param(latency_hist, bool, S_IRUGO | S_IWUSR);
+
+// Ceiling the buffers start out elastic with, 0 keeps fixed BUFFER_SIZE rings
+static unsigned long elastic_max = 0;
+module_param(elastic_max, ulong, S_IRUGO);
+
+/*
+ * In multi-writer mode every CPU gets a ring of its own. Writers that land on a CPU take
+ * its lock, so writers on different CPUs never touch the same cache lines; the readers
+ * drain all of them. Each write goes in as one record behind a struct dm510_record, padded
+ * so headers never wrap around the end of the ring.
+ */
+struct dm510_subring {
+    struct mutex lock;  // Writers on this CPU
     char *data;
-    int size;
-    int head, tail;
+    u64 size;           // Power of two, like the buffer's
+    u64 head ____cacheline_aligned_in_smp; // Advanced by the reader holding the buffer's sem
+    u64 tail ____cacheline_aligned_in_smp; // Advanced by the writer holding lock
+};
+
+struct dm510_record {
+    u32 len;
+    u32 pad;
+    u64 seq; // Order the writes were made in, 0 unless the buffer is ordered
+};
+
+static inline size_t record_size(size_t len) {
+    return sizeof(struct dm510_record) + ALIGN(len, sizeof(struct dm510_record));
+}
+
+// A write into a buffer with residency tracking: the counter past its last byte and when it went in
+struct dm510_stamp {
+    u64 end;
+    u64 ns;
+};
+
+/*
+ * Each buffer has exactly one producer (the device's single writer) and normally one
+ * consumer, so the reader owns head and the writer owns tail. Each side publishes its
+ * counter with release ordering and reads the other side's with acquire ordering, and
+ * the two counters live on separate cache lines so the sides don't bounce a line
+ * between them. Only when several readers share a buffer do they take turns on sem.
+ * The lone producer and consumer run one call at a time on the producer and consumer
+ * mutexes, whichever way the call came in: read()/write(), splice, io_uring workers or
+ * SUBMIT_BATCH. The VFS position lock only covers some of those. Broadcast readers only
+ * move their own cursors, so they take turns per open file instead.
+ *
+ * head and tail count bytes since the buffer was set up and never wrap, so tail - head
+ * is the used space and every byte of the buffer is usable. The size is a power of
+ * two and a counter is turned into an offset with a mask.
+ *
+ * head and tail sit in a control page of their own, and the data pages in a separate
+ * allocation, so a ring of 2 MB or more is whole huge pages and nothing more. A mapping
+ * puts the control page in front of the data pages, so the whole buffer can be mmap()ed
+ * and driven from user space as well.
+ *
+ * An elastic buffer has no data pages, only the control page. Its bytes live in a chain
+ * of single pages that grows at the end when the writer runs out of room, up to the
+ * ceiling in size, and gives pages back as the reader moves past them. Both sides hold
+ * sem there, since both of them change the chain.
+ *
+ * A multi-writer buffer keeps its bytes in per-CPU rings instead, see struct dm510_subring.
+ * Its readers always take turns on sem.
+ *
+ * In overwrite mode the writer moves head as well, past the oldest bytes, whenever it
+ * runs out of room. Both sides then move head with a compare-and-exchange: a reader
+ * whose exchange fails knows its copy may have been overwritten and reads again.
+ */
+struct buffer {
+    struct dm510_ring_ctrl *ctrl; // Control page holding head and tail
+    char *data;                   // Data pages, NULL for an elastic buffer
+    u64 size;             // Power of two, mask is size - 1
+    bool shared_readers;  // More than one reader open, readers serialize on sem
     struct semaphore sem;
-    wait_queue_head_t read_queue, write_queue;
+    struct percpu_rw_semaphore gate; // Held for read by transfers, for write when the path or storage changes
+    atomic_t mapped;                 // Live user mappings, the storage can't be swapped while nonzero
+    struct mutex resize_lock;        // One resize at a time
+    struct mutex producer, consumer; // Held by the calls moving tail, and head, without sem
+    wait_queue_head_t read_queue, write_queue;     // poll() and the WAIT_FOR_* commands
+    wait_queue_head_t read_sleepers, write_sleepers; // Blocked read()/write() calls, in arrival order
+    atomic64_t read_wake_at;         // Lowest tail a sleeping reader waits for, U64_MAX if none
+    atomic64_t write_wake_at;        // Lowest head a sleeping writer waits for, U64_MAX if none
+    int broadcast;                   // DM510_BROADCAST_*: every reader gets every byte, from its own cursor
+    spinlock_t readers_lock;         // Protects readers and the cursors on it
+    struct list_head readers;        // Files reading from this buffer
+    struct dm510_direct *direct;     // Pages of the reader parked on the empty ring, NULL if none
+    spinlock_t direct_lock;          // Protects direct
+    spinlock_t reserve_lock;         // Protects claimed and claims
+    u64 claimed;                     // Readers sharing the ring have claimed the bytes up to here
+    struct list_head claims;         // Claims being copied, oldest first
+    bool overwrite;                  // A full buffer makes room by dropping its oldest bytes, the writer never waits
+    atomic64_t overwritten;          // Bytes dropped that way and not yet reported to a reader
+    bool messages;                   // Holds messages, each behind a DM510_MSG_HEADER length, rather than a byte stream
+    struct dm510_subring __percpu *subrings; // Multi-writer mode: one ring per CPU, NULL otherwise
+    bool ordered;                    // Multi-writer reads follow the order of the writes
+    atomic64_t seq;                  // Last sequence number given to a record of an ordered buffer
+    u64 next_seq;                    // Sequence number the next ordered read hands out, under sem
+    unsigned int next_cpu;           // Ring unordered reads look at first, under sem
+    struct dm510_subring *partial;   // Ring whose oldest record a byte-stream read took only part of, under sem
+    u32 partial_off;                 // Payload bytes of that record already read
+    u64 elastic_limit;               // Ceiling of an elastic buffer, 0 for a fixed ring
+    struct list_head segments;       // Elastic pages, the first one holds the byte at seg_base
+    u64 seg_base;
+    unsigned int nr_segments;
+    struct list_head spares;         // Drained pages kept for reuse, the shrinker frees them
+    unsigned int nr_spares;
+    struct dm510_stamp *stamps;      // When the unread writes went in, oldest first, NULL unless tracked
+    spinlock_t stamps_lock;          // Protects the stamps and the two below
+    unsigned int first_stamp, nr_stamps;
+};
+
+// One buffer per direction: device i writes into buffers[i] and reads from the other one
+static struct buffer buffers[BUFFER_COUNT];
+
+// Spare pages across all elastic buffers, for the shrinker
+static atomic_long_t elastic_spare_pages = ATOMIC_LONG_INIT(0);
+
+/*
+ * Per device counters, kept per CPU so the data path only ever touches its own CPU's copy.
+ * They are summed up when read through debugfs, at dm510/dm510-<minor>.
+ */
+enum dm510_stat_item {
+    DM510_STAT_READ_BYTES,
+    DM510_STAT_READ_CALLS,
+    DM510_STAT_WRITE_BYTES,
+    DM510_STAT_WRITE_CALLS,
+    DM510_STAT_SHORT_READS,   // Returned fewer bytes than asked for
+    DM510_STAT_SHORT_WRITES,
+    DM510_STAT_READ_EAGAIN,
+    DM510_STAT_WRITE_EAGAIN,
+    DM510_STAT_BLOCKED,       // Transfers that went to sleep on data or space
+    DM510_STAT_WAKEUPS,       // Wake-ups for sleepers on the buffer this device writes into
+    DM510_STAT_OPEN_BUSY,     // Opens refused with -EBUSY
+    DM510_STAT_OPEN_MFILE,    // Opens refused with -EMFILE
+    DM510_STAT_CONTENDED,     // Transfers that found a buffer's sem or side mutex taken
+    NR_DM510_STATS
+};
+
+static const char * const dm510_stat_names[NR_DM510_STATS] = {
+    "read_bytes", "read_calls", "write_bytes", "write_calls", "short_reads", "short_writes",
+    "read_eagain", "write_eagain", "blocked", "wakeups", "open_busy", "open_mfile", "contended",
 };
 
-static struct buffer shared_buffer; 
+struct dm510_stats {
+    u64 count[NR_DM510_STATS];
+    u64 peak_used; // Most bytes the write buffer held after a write on this CPU
+    // Log2 histograms of nanoseconds per DM510_HIST_* phase, bucket i counts [2^i, 2^(i+1))
+    u64 hist[DM510_HIST_PHASES][DM510_HIST_BUCKETS];
+};
 
 struct dm510_device {
     struct cdev cdev;
-    struct buffer *shared_buffer;
+    struct buffer *read_buffer;  // Filled by the other device, drained by this one
+    struct buffer *write_buffer; // Filled by this device, drained by the other one
+    struct semaphore sem;        // Protects nreaders, nwriters and max_processes
     int nreaders, nwriters;
     int max_processes; // New field to limit the number of processes
+    struct dm510_stats __percpu *stats;
 };
 
 static struct dm510_device device[DEVICE_COUNT];
 
+static inline void dev_stat_add(struct dm510_device *dev, enum dm510_stat_item item, u64 n) {
+    this_cpu_add(dev->stats->count[item], n);
+}
+
+static inline void dev_stat_peak(struct dm510_device *dev, u64 used) {
+    if (used > this_cpu_read(dev->stats->peak_used))
+        this_cpu_write(dev->stats->peak_used, used);
+}
+
+// Start of a timed phase, 0 when the histograms are off
+static inline u64 hist_start(void) {
+    return READ_ONCE(latency_hist) ? ktime_get_ns() : 0;
+}
+
+static inline void hist_add(struct dm510_device *dev, int phase, u64 ns) {
+    this_cpu_inc(dev->stats->hist[phase][min(ns ? ilog2(ns) : 0, DM510_HIST_BUCKETS - 1)]);
+}
+
+static inline void hist_record(struct dm510_device *dev, int phase, u64 start) {
+    if (start)
+        hist_add(dev, phase, ktime_get_ns() - start);
+}
+
+static void dm510_hist_sum(struct dm510_device *dev, struct dm510_latency_hist *hist) {
+    struct dm510_stats *stats;
+    int cpu, phase, i;
+
+    memset(hist, 0, sizeof(*hist));
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(dev->stats, cpu);
+        for (phase = 0; phase < DM510_HIST_PHASES; phase++)
+            for (i = 0; i < DM510_HIST_BUCKETS; i++)
+                hist->bucket[phase][i] += stats->hist[phase][i];
+    }
+}
+
+// Samples landing while this runs may survive it, good enough to start a fresh measurement
+static void dm510_hist_reset(struct dm510_device *dev) {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(dev->stats, cpu)->hist, 0, sizeof(per_cpu_ptr(dev->stats, cpu)->hist));
+}
+
+/*
+ * Residency tracking stamps each write as it is published and retires the stamp once head
+ * is past its last byte, adding how long it sat in the ring to the reading device's
+ * DM510_HIST_RESIDENCY histogram. Callers hold the gate, which keeps the stamps around.
+ */
+static void residency_stamp(struct buffer *ring, u64 end) {
+    struct dm510_stamp *stamp;
+
+    spin_lock(&ring->stamps_lock);
+    if (ring->nr_stamps == RESIDENCY_STAMPS) {
+        // Out of stamps: the newest one covers these bytes too, they will look older than they are
+        ring->stamps[(ring->first_stamp + ring->nr_stamps - 1) % RESIDENCY_STAMPS].end = end;
+    } else {
+        stamp = &ring->stamps[(ring->first_stamp + ring->nr_stamps++) % RESIDENCY_STAMPS];
+        stamp->end = end;
+        stamp->ns = ktime_get_ns();
+    }
+    spin_unlock(&ring->stamps_lock);
+}
+
+// Retires the stamps of the writes below head, timing them for dev, or not at all if they were dropped (NULL)
+static void residency_consume(struct buffer *ring, struct dm510_device *dev, u64 head) {
+    struct dm510_stamp *stamp;
+    u64 now = dev ? ktime_get_ns() : 0;
+
+    spin_lock(&ring->stamps_lock);
+    while (ring->nr_stamps) {
+        stamp = &ring->stamps[ring->first_stamp];
+        if (stamp->end > head)
+            break;
+        if (dev)
+            hist_add(dev, DM510_HIST_RESIDENCY, now - stamp->ns);
+        ring->first_stamp = (ring->first_stamp + 1) % RESIDENCY_STAMPS;
+        ring->nr_stamps--;
+    }
+    spin_unlock(&ring->stamps_lock);
+}
+
+// Nanoseconds the oldest unread byte has been waiting, 0 if there is none or it went in untracked
+static u64 residency_oldest(struct buffer *ring, u64 head) {
+    struct dm510_stamp *stamp;
+    u64 age = 0;
+    unsigned int i;
+
+    spin_lock(&ring->stamps_lock);
+    for (i = 0; i < ring->nr_stamps; i++) {
+        stamp = &ring->stamps[(ring->first_stamp + i) % RESIDENCY_STAMPS];
+        if (stamp->end > head) { // Read only in part, or not at all
+            age = ktime_get_ns() - stamp->ns;
+            break;
+        }
+    }
+    spin_unlock(&ring->stamps_lock);
+    return age;
+}
+
+// Per open file settings, the file's private_data
+struct dm510_file {
+    struct dm510_device *dev;
+    size_t read_lowat;  // Bytes a blocking read waits for, 1 by default
+    size_t write_lowat; // Free bytes a blocking write waits for, 1 by default
+    ktime_t coalesce;   // Longest a read holds out for read_lowat, 0 for no limit
+    bool batch;         // Message mode reads return as many whole messages as fit, headers included
+    bool full_read;     // Blocking reads wait until the whole request is filled
+    bool full_write;    // Blocking writes wait until the whole request is stored
+    // In broadcast mode each reader reads from its own cursor, under the buffer's readers_lock;
+    // files opened without read access have no cursor and stay off the list
+    struct list_head reader_link;
+    u64 cursor;         // Next byte this reader gets, head is the lowest cursor
+    bool copying;       // Cursor taken by a read in progress, the writer can't skip it
+    struct mutex lock;  // Broadcast reads of this file, one at a time on its cursor
+    u64 lost;           // Bytes this reader never got, reported by GET_LOST_BYTES
+};
+
+// Where a reader of the buffer stands: its own cursor in broadcast mode, else the first unclaimed byte.
+// A file that doesn't read sees the buffer from the slowest reader, like a new reader would.
+static inline u64 reader_pos(struct buffer *ring, struct dm510_file *file) {
+    if (ring->broadcast)
+        return list_empty(&file->reader_link) ? smp_load_acquire(&ring->ctrl->head) : READ_ONCE(file->cursor);
+    // Bytes claimed by readers sharing the ring are gone as far as the next reader is concerned,
+    // and claimed lags behind head whenever no claims are out
+    return max(smp_load_acquire(&ring->ctrl->head), READ_ONCE(ring->claimed));
+}
+
+// Lowers a wake-up mark to target, unless a sleeper already asked to be woken earlier
+static void wake_at_lower(atomic64_t *wake_at, u64 target) {
+    s64 old = atomic64_read(wake_at);
+
+    while ((u64)old > target && !atomic64_try_cmpxchg(wake_at, &old, target))
+        ;
+    smp_mb(); // Publish the mark before the sleeper looks at the counter, pairs with buffer_wake_*()
+}
+
+static inline u64 ring_head(struct buffer *ring) {
+    return smp_load_acquire(&ring->ctrl->head); // Pairs with the reader's release
+}
+
+static inline u64 ring_tail(struct buffer *ring) {
+    return smp_load_acquire(&ring->ctrl->tail); // Pairs with the writer's release
+}
+
+// The events read the counters of struct buffer with the helpers above
+#define CREATE_TRACE_POINTS
+#include "dm510_trace.h"
+
+// Bytes buffered across the per-CPU rings, record headers and padding included
+static size_t subrings_used(struct dm510_subring __percpu *subrings) {
+    struct dm510_subring *sub;
+    size_t used = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        sub = per_cpu_ptr(subrings, cpu);
+        used += smp_load_acquire(&sub->tail) - READ_ONCE(sub->head);
+    }
+    return used;
+}
+
+/*
+ * The control page can be mapped and scribbled on by user space, so the used space is
+ * clamped to the size. Bogus counters then only garble that stream; together with the
+ * mask no transfer can reach outside the buffer. A multi-writer buffer counts what all
+ * the per-CPU rings hold, and the free space of the ring of the CPU we are on.
+ */
+static inline size_t buffer_used(struct buffer *ring, u64 head) {
+    struct dm510_subring __percpu *subrings = READ_ONCE(ring->subrings);
+
+    if (subrings)
+        return subrings_used(subrings);
+    return min_t(u64, ring_tail(ring) - head, ring->size);
+}
+
+static inline size_t buffer_free(struct buffer *ring, u64 tail) {
+    struct dm510_subring __percpu *subrings = READ_ONCE(ring->subrings);
+    struct dm510_subring *sub;
+
+    if (subrings) {
+        sub = per_cpu_ptr(subrings, raw_smp_processor_id());
+        return sub->size - (READ_ONCE(sub->tail) - smp_load_acquire(&sub->head));
+    }
+    return ring->size - min_t(u64, tail - ring_head(ring), ring->size);
+}
+
+// The device writing into a buffer has it as its write buffer and shares its index
+static inline bool buffer_has_writer(struct buffer *ring) {
+    return READ_ONCE(device[ring - buffers].nwriters) > 0;
+}
+
+// Bytes to wait for given a watermark and the request size, at least one and at most the buffer size
+static inline size_t buffer_need(struct buffer *ring, size_t lowat, size_t count) {
+    return clamp_t(u64, min(lowat, count), 1, READ_ONCE(ring->size));
+}
+
+/*
+ * Whether need bytes can be read, or anything at all once the writer is gone. If not, the
+ * reader leaves its mark so the writer wakes it when they are there; poll passes arm to
+ * leave it either way, so edge-triggered epoll hears about the next write as well. Wait
+ * conditions run without the gate, so a resize frees the old storage only after an RCU
+ * grace period.
+ */
+static bool buffer_readable(struct buffer *ring, struct dm510_file *file, size_t need, bool arm) {
+    bool ret, marked = false;
+    size_t used;
+    u64 head;
+
+    rcu_read_lock();
+    for (;;) {
+        head = reader_pos(ring, file);
+        used = buffer_used(ring, head);
+        ret = used >= need || (used && !buffer_has_writer(ring));
+        if (marked || (ret && !arm))
+            break;
+        // Per-CPU rings have no shared tail to wait for, any record wakes us
+        wake_at_lower(&ring->read_wake_at, READ_ONCE(ring->subrings) ? 0 : head + need);
+        marked = true; // Look once more, the writer may have gone past the mark already
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+// Whether need bytes are free, if not (or if armed) the writer leaves its mark so the readers wake it
+static bool buffer_writable(struct buffer *ring, size_t need, bool arm) {
+    bool ret, marked = false;
+    u64 tail;
+
+    rcu_read_lock();
+    for (;;) {
+        tail = ring_tail(ring);
+        ret = buffer_free(ring, tail) >= need;
+        if (marked || (ret && !arm))
+            break;
+        // Free space reaches need once head gets to tail + need - size, or right away while that is still
+        // below 0; a writer waiting on a per-CPU ring wakes on any read
+        wake_at_lower(&ring->write_wake_at, READ_ONCE(ring->subrings) || tail + need <= ring->size ? 0 :
+                                            tail + need - ring->size);
+        marked = true;
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+// A blocked read() or write() and how many bytes of data or space it waits for
+struct dm510_sleeper {
+    struct wait_queue_entry wq;
+    size_t need;
+};
+
+// What a wake-up hands out: bytes still to give away, and how many the first sleeper left behind is short by
+struct dm510_handout {
+    size_t budget;
+    size_t short_by;
+};
+
+// Wakes a sleeper if what is left covers it, otherwise stops the walk so nobody behind it overtakes it
+static int dm510_sleeper_wake(struct wait_queue_entry *wq, unsigned int mode, int sync, void *key) {
+    struct dm510_sleeper *sleeper = container_of(wq, struct dm510_sleeper, wq);
+    struct dm510_handout *handout = key;
+
+    if (handout->budget < sleeper->need) {
+        handout->short_by = sleeper->need - handout->budget;
+        return -1;
+    }
+    handout->budget -= sleeper->need;
+    return default_wake_function(wq, mode, sync, NULL);
+}
+
+/*
+ * Hands the data (or the space) in a buffer out to the sleeping readers (or writers) front
+ * to back, waking only as many as it covers; with all, every sleeper wakes. If the walk
+ * stops at a sleeper it can't cover, that sleeper's mark is set again.
+ */
+static void buffer_hand_out(struct buffer *ring, bool readers, bool all) {
+    wait_queue_head_t *q = readers ? &ring->read_sleepers : &ring->write_sleepers;
+    struct dm510_handout handout = { .budget = SIZE_MAX, .short_by = 0 };
+    u64 counter;
+
+    if (!waitqueue_active(q))
+        return;
+    if ((readers && ring->broadcast) || READ_ONCE(ring->subrings))
+        all = true; // Every reader gets the same bytes, or there is no single counter to share out
+    rcu_read_lock(); // Wakers may run outside the gate
+    counter = readers ? ring_tail(ring) : ring_head(ring);
+    if (!all)
+        handout.budget = readers ? buffer_used(ring, max(ring_head(ring), READ_ONCE(ring->claimed))) :
+                                   buffer_free(ring, ring_tail(ring));
+    rcu_read_unlock();
+    __wake_up(q, TASK_INTERRUPTIBLE, 0, &handout);
+    if (handout.short_by)
+        wake_at_lower(readers ? &ring->read_wake_at : &ring->write_wake_at, counter + handout.short_by);
+}
+
+/*
+ * Sleepers leave the tail (or head) they are waiting for in a wake-up mark, and a transfer
+ * only wakes anyone once the counter passes the lowest mark. A buffer nobody sleeps on
+ * costs the other side no wake-ups at all, and a reader waiting for a watermark isn't
+ * woken for every few bytes. The mark is cleared on each wake-up; whoever still has to
+ * wait sets it again when it rechecks its condition. A counter of U64_MAX wakes everyone.
+ * Multi-writer buffers pass 0, which only wakes sleepers that left a mark at all.
+ */
+static void buffer_wake_readers(struct buffer *ring, u64 tail) {
+    smp_mb(); // Publish tail before reading the mark, pairs with wake_at_lower()
+    if (tail < (u64)atomic64_read(&ring->read_wake_at))
+        return;
+    atomic64_set(&ring->read_wake_at, U64_MAX);
+    dev_stat_add(&device[ring - buffers], DM510_STAT_WAKEUPS, 1);
+    wake_up_interruptible_poll(&ring->read_queue, EPOLLIN | EPOLLRDNORM);
+    buffer_hand_out(ring, true, tail == U64_MAX);
+}
+
+static void buffer_wake_writers(struct buffer *ring, u64 head) {
+    smp_mb(); // Publish head before reading the mark, pairs with wake_at_lower()
+    if (head < (u64)atomic64_read(&ring->write_wake_at))
+        return;
+    atomic64_set(&ring->write_wake_at, U64_MAX);
+    dev_stat_add(&device[ring - buffers], DM510_STAT_WAKEUPS, 1);
+    wake_up_interruptible_poll(&ring->write_queue, EPOLLOUT | EPOLLWRNORM);
+    buffer_hand_out(ring, false, head == U64_MAX);
+}
+
+/*
+ * Sleeps until need bytes can be read (or written) without giving up the place in line:
+ * the sleeper stays queued, exclusively, until it returns. Returns 0, -ETIME once the
+ * deadline (if there is one) has passed, or -ERESTARTSYS.
+ */
+static int buffer_sleep(struct buffer *ring, struct dm510_file *file, bool reader, size_t need, ktime_t deadline) {
+    wait_queue_head_t *q = reader ? &ring->read_sleepers : &ring->write_sleepers;
+    struct dm510_sleeper sleeper = { .need = need };
+    bool blocked = false;
+    u64 start = 0;
+    int ret = 0;
+
+    init_wait_func(&sleeper.wq, dm510_sleeper_wake);
+    add_wait_queue_exclusive(q, &sleeper.wq);
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (reader ? buffer_readable(ring, file, need, false) : buffer_writable(ring, need, false))
+            break;
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        if (!blocked) {
+            dev_stat_add(file->dev, DM510_STAT_BLOCKED, 1);
+            trace_dm510_block(file->dev - device, reader, need);
+            start = hist_start();
+            blocked = true;
+        }
+        if (!deadline) {
+            schedule();
+        } else if (!schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS)) {
+            ret = -ETIME;
+            break;
+        }
+    }
+    __set_current_state(TASK_RUNNING);
+    remove_wait_queue(q, &sleeper.wq);
+    hist_record(file->dev, reader ? DM510_HIST_READ_WAIT : DM510_HIST_WRITE_WAIT, start);
+    if (blocked)
+        trace_dm510_wakeup(file->dev - device, reader, ret);
+    // Leaving early, so the sleepers behind us may have been held up for nothing: give them a look
+    if (ret)
+        buffer_hand_out(ring, reader, false);
+    return ret;
+}
+
+/*
+ * A reader that would sleep on an empty ring can pin the pages of its read and offer them
+ * to the writer instead. The next write then copies straight into them, one copy instead
+ * of two, and the ring is only used when nobody is parked. Only plain byte-stream rings
+ * with one reader and one writer do this, where the order of the bytes is plain to see:
+ * the writer only takes an offer while the ring is empty, so the bytes it hands over come
+ * before anything it writes into the ring afterwards. A reader killed while the writer
+ * copies leaves the offer to the writer, which puts its bytes into the ring instead.
+ */
+enum { DIRECT_OFFERED, DIRECT_TAKEN, DIRECT_FILLED, DIRECT_ABANDONED };
+
+struct dm510_direct {
+    refcount_t ref; // The reader's, plus the writer's once it takes the offer
+    struct task_struct *task;
+    struct page *pages[DIRECT_PAGES];
+    unsigned int nr_pages;
+    size_t offset;  // Into the first page
+    size_t len;     // Bytes offered
+    size_t filled;  // Bytes the writer copied in
+    int state;
+};
+
+static inline bool direct_eligible(struct buffer *ring) {
+    return !ring->messages && !ring->broadcast && !ring->subrings && !ring->overwrite &&
+           !ring->elastic_limit && !ring->shared_readers;
+}
+
+// Drops a reference to an offer, the last one lets go of the pages and the reader's task
+static void direct_put(struct dm510_direct *offer) {
+    if (!refcount_dec_and_test(&offer->ref))
+        return;
+    unpin_user_pages_dirty_lock(offer->pages, offer->nr_pages, offer->filled > 0);
+    put_task_struct(offer->task);
+    kfree(offer);
+}
+
+/*
+ * Parks the reader with its pages offered to the writer, until the writer has filled
+ * them or bytes turn up in the ring after all. Returns the bytes handed over, 0 if none
+ * were and the read should go to the ring, -ERESTARTSYS, or -EINTR if the reader was
+ * killed while the writer was copying.
+ */
+
+static ssize_t direct_read(struct buffer *ring, struct dm510_file *file, struct iov_iter *to) {
+    struct dm510_direct *offer;
+    struct dm510_sleeper sleeper = { .need = 1 };
+    struct page **pages;
+    bool posted = false;
+    u64 start = 0;
+    ssize_t len, filled;
+
+    offer = kmalloc(sizeof(*offer), GFP_KERNEL);
+    if (!offer)
+        return 0; // Wait in the ring like any reader
+    pages = offer->pages;
+    len = iov_iter_extract_pages(to, &pages, iov_iter_count(to), DIRECT_PAGES, 0, &offer->offset);
+    if (len <= 0) {
+        kfree(offer);
+        return 0;
+    }
+    refcount_set(&offer->ref, 1);
+    // The writer wakes us through the offer, which may outlive us if we get killed
+    offer->task = current;
+    get_task_struct(offer->task);
+    offer->state = DIRECT_OFFERED;
+    offer->len = len;
+    offer->filled = 0;
+    offer->nr_pages = DIV_ROUND_UP(offer->offset + len, PAGE_SIZE);
+
+    // Writes into the ring still wake us, like any reader in line
+    init_wait_func(&sleeper.wq, dm510_sleeper_wake);
+    add_wait_queue_exclusive(&ring->read_sleepers, &sleeper.wq);
+    spin_lock(&ring->direct_lock);
+    rcu_read_lock(); // No gate here, a resize frees the old control page only after a grace period
+    if (!ring->direct && ring_tail(ring) == ring_head(ring)) {
+        ring->direct = offer;
+        posted = true;
+    }
+    rcu_read_unlock();
+    spin_unlock(&ring->direct_lock);
+    if (posted) {
+        dev_stat_add(file->dev, DM510_STAT_BLOCKED, 1);
+        trace_dm510_block(file->dev - device, true, 1);
+        start = hist_start();
+    }
+    while (posted) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (smp_load_acquire(&offer->state) == DIRECT_FILLED || buffer_readable(ring, file, 1, false) ||
+            signal_pending(current))
+            break;
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    remove_wait_queue(&ring->read_sleepers, &sleeper.wq);
+
+    // Take the offer back, unless the writer got to it first and is copying into the pages
+    spin_lock(&ring->direct_lock);
+    if (ring->direct == offer)
+        ring->direct = NULL;
+    spin_unlock(&ring->direct_lock);
+    while (posted && smp_load_acquire(&offer->state) == DIRECT_TAKEN) {
+        // The copy can fault and take a while, user space has to be able to kill us meanwhile
+        set_current_state(TASK_KILLABLE);
+        if (smp_load_acquire(&offer->state) == DIRECT_FILLED)
+            break;
+        if (fatal_signal_pending(current)) {
+            int taken = DIRECT_TAKEN;
+
+            // Still copying: the writer finds the offer abandoned and keeps its bytes
+            if (try_cmpxchg(&offer->state, &taken, DIRECT_ABANDONED))
+                break;
+            continue; // Filled meanwhile
+        }
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    hist_record(file->dev, DM510_HIST_READ_WAIT, start);
+
+    if (posted && smp_load_acquire(&offer->state) == DIRECT_ABANDONED) {
+        trace_dm510_wakeup(file->dev - device, true, -EINTR);
+        iov_iter_revert(to, offer->len);
+        direct_put(offer);
+        return -EINTR; // Dying anyway
+    }
+    filled = offer->filled;
+    if (posted)
+        trace_dm510_wakeup(file->dev - device, true, filled || !signal_pending(current) ? 0 : -ERESTARTSYS);
+    iov_iter_revert(to, offer->len - filled);
+    direct_put(offer);
+    if (filled)
+        return filled;
+    return signal_pending(current) ? -ERESTARTSYS : 0;
+}
+
+// Copies the start of a write into the pages of a parked reader, returns how many bytes went there
+static size_t direct_write(struct buffer *ring, struct iov_iter *from) {
+    struct dm510_direct *offer;
+    size_t offset, chunk, copied, filled = 0;
+    int taken = DIRECT_TAKEN;
+    unsigned int i;
+
+    spin_lock(&ring->direct_lock);
+    offer = ring->direct;
+    if (offer && ring_tail(ring) == ring_head(ring)) {
+        ring->direct = NULL;
+        refcount_inc(&offer->ref);
+        offer->state = DIRECT_TAKEN; // The reader waits for us from here on
+    } else {
+        offer = NULL;
+    }
+    spin_unlock(&ring->direct_lock);
+    if (!offer)
+        return 0;
+
+    offset = offer->offset;
+    for (i = 0; i < offer->nr_pages && filled < offer->len; i++) {
+        chunk = min(offer->len - filled, (size_t)(PAGE_SIZE - offset));
+        copied = copy_page_from_iter(offer->pages[i], offset, chunk, from);
+        filled += copied;
+        if (copied < chunk)
+            break;
+        offset = 0;
+    }
+    offer->filled = filled;
+    // The reader may go away once it sees FILLED, the offer keeps its task around for the wake-up
+    if (try_cmpxchg_release(&offer->state, &taken, DIRECT_FILLED)) {
+        wake_up_process(offer->task);
+    } else {
+        // Killed while we copied: nobody gets these bytes, so they go into the ring after all
+        iov_iter_revert(from, filled);
+        offer->filled = filled = 0;
+    }
+    direct_put(offer);
+    return filled;
+}
+
+/*
+ * Broadcast mode: head is the cursor of the slowest reader, so space only comes back once
+ * every reader has had the bytes. Moves head up to the lowest cursor and returns it.
+ * Called with readers_lock held.
+ */
+static u64 broadcast_advance(struct buffer *ring) {
+    u64 head = ring_head(ring), low = U64_MAX;
+    struct dm510_file *reader;
+
+    list_for_each_entry(reader, &ring->readers, reader_link)
+        low = min(low, reader->cursor);
+    if (low != U64_MAX && low > head) {
+        smp_store_release(&ring->ctrl->head, low);
+        head = low;
+    }
+    return head;
+}
+
+// Takes the reader's cursor for a read, the writer leaves it alone until it is committed
+static u64 broadcast_claim(struct buffer *ring, struct dm510_file *file) {
+    u64 pos;
+
+    spin_lock(&ring->readers_lock);
+    file->copying = true;
+    pos = file->cursor;
+    spin_unlock(&ring->readers_lock);
+    return pos;
+}
+
+// Puts the cursor back at pos after a read and returns the new head
+static u64 broadcast_commit(struct buffer *ring, struct dm510_file *file, u64 pos) {
+    u64 head;
+
+    spin_lock(&ring->readers_lock);
+    file->cursor = pos;
+    file->copying = false;
+    head = broadcast_advance(ring);
+    spin_unlock(&ring->readers_lock);
+    return head;
+}
+
+// Pushes readers that lag behind target, and aren't in the middle of a read, up to it
+static u64 broadcast_skip(struct buffer *ring, u64 target) {
+    struct dm510_file *reader;
+    u64 head;
+
+    spin_lock(&ring->readers_lock);
+    list_for_each_entry(reader, &ring->readers, reader_link) {
+        if (!reader->copying && reader->cursor < target) {
+            reader->lost += target - reader->cursor;
+            reader->cursor = target;
+        }
+    }
+    head = broadcast_advance(ring);
+    spin_unlock(&ring->readers_lock);
+    return head;
+}
+
+// Puts a reader on its buffer's list, starting from the oldest byte still buffered
+static void reader_attach(struct buffer *ring, struct dm510_file *file) {
+    percpu_down_read(&ring->gate); // The control page stays put
+    spin_lock(&ring->readers_lock);
+    file->cursor = ring_head(ring);
+    file->copying = false;
+    file->lost = 0;
+    list_add_tail(&file->reader_link, &ring->readers);
+    spin_unlock(&ring->readers_lock);
+    percpu_up_read(&ring->gate);
+}
+
+static void reader_detach(struct buffer *ring, struct dm510_file *file) {
+    u64 head;
+
+    percpu_down_read(&ring->gate);
+    spin_lock(&ring->readers_lock);
+    list_del(&file->reader_link);
+    // A broadcast writer may have been waiting on this reader alone
+    head = ring->broadcast ? broadcast_advance(ring) : ring_head(ring);
+    spin_unlock(&ring->readers_lock);
+    percpu_up_read(&ring->gate);
+    buffer_wake_writers(ring, head);
+}
+
+// Switches a buffer between the lock-free single reader path and the shared reader path
+static void buffer_set_readers(struct buffer *ring, int nreaders) {
+    bool shared = nreaders > 1;
+
+    if (shared == ring->shared_readers)
+        return;
+    percpu_down_write(&ring->gate); // Waits for transfers that already picked a path
+    ring->shared_readers = shared;
+    percpu_up_write(&ring->gate);
+}
+
 static int dm510_open(struct inode *inode, struct file *filp) {
     struct dm510_device *dev =  container_of(inode->i_cdev, struct dm510_device, cdev);
-    filp->private_data = dev;
+    struct dm510_file *file = kzalloc(sizeof(*file), GFP_KERNEL);
+
+    if (!file)
+        return -ENOMEM;
+    file->dev = dev;
+    file->read_lowat = file->write_lowat = 1;
+    file->coalesce = 0;
+    file->batch = false;
+    file->full_read = file->full_write = false;
+    INIT_LIST_HEAD(&file->reader_link); // Until reader_attach() gives it a cursor
+    mutex_init(&file->lock);
+    filp->private_data = file;
+
+    // Pipe-like device: no seeking. Calls sharing one open file take turns in the driver,
+    // on the buffer's producer and consumer mutexes or, reading a broadcast buffer, on the file's
+    stream_open(inode, filp);
+    // read_iter/write_iter honour IOCB_NOWAIT, so io_uring can issue them inline
+    filp->f_mode |= FMODE_NOWAIT;
 
-    if (down_interruptible(&shared_buffer.sem))
+    if (down_interruptible(&dev->sem)) {
+        kfree(file);
         return -ERESTARTSYS;
+    }
     switch (filp->f_flags & O_ACCMODE) {
 	    // Will be denind writing acces, becues device is busy
         case O_WRONLY:
-            if (dev->nwriters) {
-                up(&shared_buffer.sem);
+            // Any number of writers in multi-writer mode, each CPU has a ring of its own
+            if (dev->nwriters && !dev->write_buffer->subrings) {
+                dev_stat_add(dev, DM510_STAT_OPEN_BUSY, 1);
+                up(&dev->sem);
+                kfree(file);
+                trace_dm510_open(dev - device, filp->f_flags, -EBUSY);
                 return -EBUSY;
             }
             dev->nwriters++;
@@ -57,16 +900,25 @@ static int dm510_open(struct inode *inode, struct file *filp) {
         case O_RDONLY:
 		// Will be dening access, becues there are to many readers
             if (dev->nreaders >= dev->max_processes) {
-                up(&shared_buffer.sem);
+                dev_stat_add(dev, DM510_STAT_OPEN_MFILE, 1);
+                up(&dev->sem);
+                kfree(file);
+                trace_dm510_open(dev - device, filp->f_flags, -EMFILE);
                 return -EMFILE;
             }
             dev->nreaders++;
             break;
         case O_RDWR:
 		// Will be denine read/write access becuse device is busy
-            if (dev->nwriters || (dev->nreaders > 0 && dev->nreaders >= dev->max_processes)) {
-                up(&shared_buffer.sem);
-                return (dev->nwriters) ? -EBUSY : -EMFILE;
+            if ((dev->nwriters && !dev->write_buffer->subrings) ||
+                (dev->nreaders > 0 && dev->nreaders >= dev->max_processes)) {
+                bool busy = dev->nwriters && !dev->write_buffer->subrings;
+
+                dev_stat_add(dev, busy ? DM510_STAT_OPEN_BUSY : DM510_STAT_OPEN_MFILE, 1);
+                up(&dev->sem);
+                kfree(file);
+                trace_dm510_open(dev - device, filp->f_flags, busy ? -EBUSY : -EMFILE);
+                return busy ? -EBUSY : -EMFILE;
             }
             // This needs to check max_processes for readers as well
 	    // Will be denine access becues there are too many readers
@@ -74,168 +926,1492 @@ static int dm510_open(struct inode *inode, struct file *filp) {
             dev->nreaders++;
             break;
     }
-    up(&shared_buffer.sem);
-    return 0;
-}
+    buffer_set_readers(dev->read_buffer, dev->nreaders);
+    up(&dev->sem);
+    if (filp->f_mode & FMODE_READ)
+        reader_attach(dev->read_buffer, file);
+    trace_dm510_open(dev - device, filp->f_flags, 0);
+    return 0;
+}
+
+
+static int dm510_release(struct inode *inode, struct file *filp) {
+    struct dm510_file *file = filp->private_data;
+    struct dm510_device *dev = file->dev;
+
+
+    down(&dev->sem);
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY || (filp->f_flags & O_ACCMODE) == O_RDWR) {
+        dev->nwriters--;
+    }
+    if ((filp->f_flags & O_ACCMODE) == O_RDONLY || (filp->f_flags & O_ACCMODE) == O_RDWR) {
+        dev->nreaders--;
+    }
+    buffer_set_readers(dev->read_buffer, dev->nreaders);
+    trace_dm510_release(dev - device, filp->f_flags, dev->nreaders, dev->nwriters);
+    up(&dev->sem);
+    if (filp->f_mode & FMODE_READ)
+        reader_detach(dev->read_buffer, file);
+    // Readers holding out for a watermark take what is left once the writer is gone
+    if (filp->f_mode & FMODE_WRITE)
+        buffer_wake_readers(dev->write_buffer, U64_MAX);
+    kfree(file);
+    return 0;
+}
+
+
+static struct page *elastic_get_page(struct buffer *ring) {
+    struct page *page;
+
+    if (!ring->nr_spares)
+        return alloc_page(GFP_KERNEL_ACCOUNT | __GFP_NOWARN);
+    page = list_first_entry(&ring->spares, struct page, lru);
+    list_del(&page->lru);
+    ring->nr_spares--;
+    atomic_long_dec(&elastic_spare_pages);
+    return page;
+}
+
+static void elastic_put_page(struct buffer *ring, struct page *page) {
+    if (ring->nr_spares >= ELASTIC_SPARES) {
+        __free_page(page);
+        return;
+    }
+    list_add(&page->lru, &ring->spares);
+    ring->nr_spares++;
+    atomic_long_inc(&elastic_spare_pages);
+}
+
+// Frees up to nr spare pages and returns how many went
+static unsigned long elastic_free_spares(struct buffer *ring, unsigned long nr) {
+    unsigned long freed = 0;
+    struct page *page;
+
+    while (ring->nr_spares && freed < nr) {
+        page = list_first_entry(&ring->spares, struct page, lru);
+        list_del(&page->lru);
+        ring->nr_spares--;
+        __free_page(page);
+        freed++;
+    }
+    atomic_long_sub(freed, &elastic_spare_pages);
+    return freed;
+}
+
+// Frees every page of an elastic buffer, which has to be empty
+static void elastic_release(struct buffer *ring) {
+    struct page *page;
+
+    while (ring->nr_segments) {
+        page = list_first_entry(&ring->segments, struct page, lru);
+        list_del(&page->lru);
+        ring->nr_segments--;
+        __free_page(page);
+    }
+    elastic_free_spares(ring, ULONG_MAX);
+}
+
+// The page holding the byte at counter pos, walked to from the nearer end of the chain
+static struct page *elastic_page(struct buffer *ring, u64 pos) {
+    unsigned int index = (pos - ring->seg_base) >> PAGE_SHIFT;
+    struct page *page;
+
+    if (index < ring->nr_segments / 2) {
+        page = list_first_entry(&ring->segments, struct page, lru);
+        while (index--)
+            page = list_next_entry(page, lru);
+    } else {
+        page = list_last_entry(&ring->segments, struct page, lru);
+        for (index = ring->nr_segments - 1 - index; index; index--)
+            page = list_prev_entry(page, lru);
+    }
+    return page;
+}
+
+// Grows the chain so count bytes fit behind tail and returns how many do, fewer if pages run out
+static size_t elastic_reserve(struct buffer *ring, u64 tail, size_t count) {
+    u64 end = ring->seg_base + ((u64)ring->nr_segments << PAGE_SHIFT);
+    struct page *page;
+
+    while (end - tail < count) {
+        page = elastic_get_page(ring);
+        if (!page)
+            break;
+        list_add_tail(&page->lru, &ring->segments);
+        ring->nr_segments++;
+        end += PAGE_SIZE;
+    }
+    return min_t(u64, count, end - tail);
+}
+
+// Gives back the pages the reader has moved past
+static void elastic_trim(struct buffer *ring, u64 head) {
+    struct page *page;
+
+    while (ring->nr_segments && head - ring->seg_base >= PAGE_SIZE) {
+        page = list_first_entry(&ring->segments, struct page, lru);
+        list_del(&page->lru);
+        ring->nr_segments--;
+        ring->seg_base += PAGE_SIZE;
+        elastic_put_page(ring, page);
+    }
+}
+
+// Copies count bytes starting at counter pos out of the buffer, returns how many made it
+static size_t buffer_copy_to_iter(struct buffer *ring, u64 pos, size_t count, struct iov_iter *to) {
+    size_t offset, first_part_size, chunk, copied = 0;
+    struct page *page;
+
+    if (!ring->elastic_limit) {
+        offset = pos & (ring->size - 1);
+        first_part_size = min(count, (size_t)(ring->size - offset));
+        copied = copy_to_iter(ring->data + offset, first_part_size, to);
+        // If data wraps around to the beginning of the buffer
+        if (copied == first_part_size && count > first_part_size)
+            copied += copy_to_iter(ring->data, count - first_part_size, to);
+        return copied;
+    }
+
+    page = elastic_page(ring, pos);
+    offset = (pos - ring->seg_base) & (PAGE_SIZE - 1);
+    while (copied < count) {
+        chunk = min(count - copied, (size_t)(PAGE_SIZE - offset));
+        if (copy_page_to_iter(page, offset, chunk, to) != chunk)
+            break;
+        copied += chunk;
+        offset = 0;
+        page = list_next_entry(page, lru);
+    }
+    return copied;
+}
+
+// Copies count bytes into the buffer starting at counter pos, returns how many made it
+static size_t buffer_copy_from_iter(struct buffer *ring, u64 pos, size_t count, struct iov_iter *from) {
+    size_t offset, first_part_size, chunk, copied = 0;
+    struct page *page;
+
+    if (!ring->elastic_limit) {
+        offset = pos & (ring->size - 1);
+        first_part_size = min(count, (size_t)(ring->size - offset));
+        copied = copy_from_iter(ring->data + offset, first_part_size, from);
+        // If data wraps around to the beginning of the buffer
+        if (copied == first_part_size && count > first_part_size)
+            copied += copy_from_iter(ring->data, count - first_part_size, from);
+        return copied;
+    }
+
+    page = elastic_page(ring, pos);
+    offset = (pos - ring->seg_base) & (PAGE_SIZE - 1);
+    while (copied < count) {
+        chunk = min(count - copied, (size_t)(PAGE_SIZE - offset));
+        if (copy_page_from_iter(page, offset, chunk, from) != chunk)
+            break;
+        copied += chunk;
+        offset = 0;
+        page = list_next_entry(page, lru);
+    }
+    return copied;
+}
+
+// Takes the producer or consumer mutex of a buffer, the caller isn't inside the gate.
+// Waiting for it counts as contention and lock time, like waiting for sem.
+static int buffer_side_lock(struct dm510_device *dev, struct mutex *side, bool reader, bool nonblock) {
+    u64 start;
+
+    if (mutex_trylock(side))
+        return 0;
+    dev_stat_add(dev, DM510_STAT_CONTENDED, 1);
+    if (nonblock)
+        return -EAGAIN;
+    start = hist_start();
+    if (mutex_lock_interruptible(side))
+        return -ERESTARTSYS;
+    hist_record(dev, reader ? DM510_HIST_READ_LOCK : DM510_HIST_WRITE_LOCK, start);
+    return 0;
+}
+
+// Enters a buffer: the gate, plus the semaphore where the sides can't do without it
+static int buffer_enter(struct buffer *ring, struct dm510_device *dev, bool reader, bool nowait, bool *locked) {
+    if (nowait) {
+        if (!percpu_down_read_trylock(&ring->gate))
+            return -EAGAIN;
+    } else {
+        percpu_down_read(&ring->gate);
+    }
+    // Readers of per-CPU rings merge them, readers sharing an overwrite ring race the writer for
+    // head, and elastic pages come and go on both sides. Other readers claim their bytes instead.
+    *locked = ring->elastic_limit || (reader && (ring->subrings || (ring->shared_readers && ring->overwrite)));
+    if (*locked && down_trylock(&ring->sem)) {
+        u64 start = nowait ? 0 : hist_start();
+
+        dev_stat_add(dev, DM510_STAT_CONTENDED, 1);
+        if (nowait || down_interruptible(&ring->sem)) {
+            percpu_up_read(&ring->gate);
+            return nowait ? -EAGAIN : -ERESTARTSYS;
+        }
+        hist_record(dev, reader ? DM510_HIST_READ_LOCK : DM510_HIST_WRITE_LOCK, start);
+    }
+    return 0;
+}
+
+static void buffer_exit(struct buffer *ring, bool locked) {
+    if (locked)
+        up(&ring->sem);
+    percpu_up_read(&ring->gate);
+}
+
+// Copies len bytes at counter pos out of the buffer into a kernel buffer
+static size_t buffer_peek(struct buffer *ring, u64 pos, void *dst, size_t len) {
+    struct kvec kv = { .iov_base = dst, .iov_len = len };
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, len);
+    return buffer_copy_to_iter(ring, pos, len, &iter);
+}
+
+// Copies len bytes from a kernel buffer into the buffer at counter pos
+static size_t buffer_poke(struct buffer *ring, u64 pos, const void *src, size_t len) {
+    struct kvec kv = { .iov_base = (void *)src, .iov_len = len };
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+    return buffer_copy_from_iter(ring, pos, len, &iter);
+}
+
+/*
+ * Length of the message at counter pos, or -EIO if its header claims more than is buffered
+ * (a mapped producer can write anything). Writers publish a message only once it is whole,
+ * so a header that is there means the payload is there too.
+ */
+static long message_peek(struct buffer *ring, u64 pos, size_t available) {
+    u32 len;
+
+    if (available < DM510_MSG_HEADER)
+        return -EIO;
+    buffer_peek(ring, pos, &len, sizeof(len));
+    if (len > available - DM510_MSG_HEADER)
+        return -EIO;
+    return len;
+}
+
+/*
+ * Works out what a read of count bytes gets at head: the message there, or in batch mode
+ * as many whole messages as fit, each with its header. Returns how many bytes to copy,
+ * starting *skip bytes past head. A message is never split: if the first one doesn't fit,
+ * nothing is read and the caller gets -EMSGSIZE.
+ */
+static long message_span(struct buffer *ring, bool batch, u64 head, size_t available,
+                         size_t count, size_t *skip) {
+    size_t total = 0;
+    long len = 0;
+
+    if (!batch) {
+        len = message_peek(ring, head, available);
+        if (len < 0)
+            return len;
+        if (len > count)
+            return -EMSGSIZE;
+        *skip = DM510_MSG_HEADER; // The bare payload
+        return len;
+    }
+
+    while (total < available) {
+        len = message_peek(ring, head + total, available - total);
+        if (len < 0 || DM510_MSG_HEADER + len > count - total)
+            break;
+        total += DM510_MSG_HEADER + len;
+    }
+    if (!total)
+        return len < 0 ? len : -EMSGSIZE;
+    *skip = 0;
+    return total;
+}
+
+// Stores the whole iov_iter as one message at tail, the caller has made room for it and its header
+static ssize_t message_write(struct buffer *ring, u64 tail, size_t count, struct iov_iter *from) {
+    u32 len = count;
+
+    if (buffer_poke(ring, tail, &len, sizeof(len)) != sizeof(len) ||
+        buffer_copy_from_iter(ring, tail + DM510_MSG_HEADER, count, from) != count)
+        return -EFAULT;
+    return count;
+}
+
+// Copies count bytes out of a per-CPU ring starting at counter pos
+static size_t subring_copy_to_iter(struct dm510_subring *sub, u64 pos, size_t count, struct iov_iter *to) {
+    size_t offset = pos & (sub->size - 1);
+    size_t first_part_size = min(count, (size_t)(sub->size - offset));
+    size_t copied = copy_to_iter(sub->data + offset, first_part_size, to);
+
+    if (copied == first_part_size && count > first_part_size)
+        copied += copy_to_iter(sub->data, count - first_part_size, to);
+    return copied;
+}
+
+static size_t subring_copy_from_iter(struct dm510_subring *sub, u64 pos, size_t count, struct iov_iter *from) {
+    size_t offset = pos & (sub->size - 1);
+    size_t first_part_size = min(count, (size_t)(sub->size - offset));
+    size_t copied = copy_from_iter(sub->data + offset, first_part_size, from);
+
+    if (copied == first_part_size && count > first_part_size)
+        copied += copy_from_iter(sub->data, count - first_part_size, from);
+    return copied;
+}
+
+// Reads the header of the oldest record in a per-CPU ring, if there is one
+static bool subring_peek(struct dm510_subring *sub, struct dm510_record *rec) {
+    u64 head = sub->head;
+
+    if (smp_load_acquire(&sub->tail) == head)
+        return false;
+    memcpy(rec, sub->data + (head & (sub->size - 1)), sizeof(*rec));
+    return true;
+}
+
+/*
+ * Picks the per-CPU ring the next record comes from. Ordered buffers hand out the record
+ * with the next sequence number; one that is numbered but not there yet is being published
+ * with preemption off, so it is only a few instructions away. Otherwise the rings take
+ * turns, one record each. Called with sem held.
+ */
+static struct dm510_subring *subring_next(struct buffer *ring, struct dm510_record *rec) {
+    struct dm510_subring *sub;
+    unsigned int i, cpu;
+
+    if (ring->partial && subring_peek(ring->partial, rec))
+        return ring->partial; // Finish the record a read cut short first
+    if (ring->ordered) {
+        for (;;) {
+            for_each_possible_cpu(cpu) {
+                sub = per_cpu_ptr(ring->subrings, cpu);
+                if (subring_peek(sub, rec) && rec->seq == ring->next_seq)
+                    return sub;
+            }
+            if ((u64)atomic64_read(&ring->seq) < ring->next_seq)
+                return NULL; // Nothing written since
+            cpu_relax();
+        }
+    }
+
+    for (i = 0; i < nr_cpu_ids; i++) {
+        cpu = (ring->next_cpu + i) % nr_cpu_ids;
+        if (!cpu_possible(cpu))
+            continue;
+        sub = per_cpu_ptr(ring->subrings, cpu);
+        if (subring_peek(sub, rec)) {
+            ring->next_cpu = cpu + 1;
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Drains records from the per-CPU rings into the read. A byte stream gets the payloads
+ * back to back, and a record that doesn't fit fills the rest of the read; what is left of
+ * it stays at the head of its ring and goes first to the next read, so writes still come
+ * out in one piece. In message mode a read gets one record, or with batch as many as fit,
+ * each behind a DM510_MSG_HEADER, and -EMSGSIZE if the first one doesn't fit. -EAGAIN if
+ * there is none. Called with sem held.
+ */
+static ssize_t subring_read(struct buffer *ring, struct dm510_file *file, struct iov_iter *to) {
+    size_t count = iov_iter_count(to), total = 0, len, skip;
+    bool headers = ring->messages && file->batch;
+    struct dm510_subring *sub;
+    struct dm510_record rec;
+
+    while (total < count && (sub = subring_next(ring, &rec))) {
+        skip = sub == ring->partial ? ring->partial_off : 0;
+        len = rec.len - skip + (headers ? DM510_MSG_HEADER : 0);
+        if (len > count - total) {
+            if (ring->messages) {
+                if (!total)
+                    return -EMSGSIZE;
+                break;
+            }
+            len = subring_copy_to_iter(sub, sub->head + sizeof(rec) + skip, count - total, to);
+            if (!len)
+                return total ? total : -EFAULT;
+            ring->partial = sub;
+            ring->partial_off = skip + len;
+            return total + len;
+        }
+        if ((headers && copy_to_iter(&rec.len, DM510_MSG_HEADER, to) != DM510_MSG_HEADER) ||
+            subring_copy_to_iter(sub, sub->head + sizeof(rec) + skip, rec.len - skip, to) != rec.len - skip)
+            return total ? total : -EFAULT;
+        smp_store_release(&sub->head, sub->head + record_size(rec.len));
+        ring->partial = NULL;
+        ring->next_seq++;
+        total += len;
+        if (ring->messages && !file->batch)
+            break; // One message per read
+    }
+    return total ? total : -EAGAIN;
+}
+
+/*
+ * Stores the whole iov_iter as one record in the ring of the CPU we are on. Returns
+ * -ENOSPC when it doesn't have room yet, -EMSGSIZE if it never will.
+ */
+static ssize_t subring_write(struct buffer *ring, struct iov_iter *from, size_t count, bool nowait) {
+    struct dm510_subring *sub = per_cpu_ptr(ring->subrings, raw_smp_processor_id());
+    struct dm510_record rec = { .len = count };
+    size_t size = record_size(count);
+    u64 tail;
+
+    if (count > U32_MAX || size > sub->size)
+        return -EMSGSIZE;
+    if (nowait ? !mutex_trylock(&sub->lock) : mutex_lock_interruptible(&sub->lock))
+        return nowait ? -EAGAIN : -ERESTARTSYS;
+    tail = sub->tail;
+    if (sub->size - (tail - smp_load_acquire(&sub->head)) < size) {
+        mutex_unlock(&sub->lock);
+        return -ENOSPC;
+    }
+    if (subring_copy_from_iter(sub, tail + sizeof(rec), count, from) != count) {
+        mutex_unlock(&sub->lock);
+        return -EFAULT;
+    }
+    // Numbered and published in one go, so ordered readers never wait on a preempted writer
+    preempt_disable();
+    if (ring->ordered)
+        rec.seq = atomic64_inc_return(&ring->seq);
+    memcpy(sub->data + (tail & (sub->size - 1)), &rec, sizeof(rec));
+    smp_store_release(&sub->tail, tail + size);
+    preempt_enable();
+    mutex_unlock(&sub->lock);
+    return count;
+}
+
+/*
+ * Readers sharing a plain ring reserve their bytes instead of taking turns on sem: under
+ * reserve_lock a reader moves claimed past what it is going to read and queues a claim,
+ * then copies without any lock. Claims are contiguous, in the order they were made, and
+ * head only moves past a claim once every claim before it is done too, so the writer
+ * never gets back bytes that are still being copied. Elastic, overwrite, broadcast and
+ * multi-writer buffers move head by their own rules and keep their locking.
+ */
+struct dm510_claim {
+    struct list_head link;
+    u64 own_end; // claimed when the claim was made
+    u64 end;     // own_end, or the end of later claims that committed first and handed their range down
+};
+
+static inline bool buffer_reserving(struct buffer *ring) {
+    return ring->shared_readers && !ring->broadcast && !ring->overwrite && !ring->elastic_limit && !ring->subrings;
+}
+
+// Where the next claim starts, called with reserve_lock held
+static u64 reserve_start(struct buffer *ring) {
+    // With no claims out head is where they left off, or where another mode left it
+    if (list_empty(&ring->claims))
+        ring->claimed = ring_head(ring);
+    return ring->claimed;
+}
+
+static void reserve_claim(struct buffer *ring, struct dm510_claim *claim, u64 end) {
+    claim->own_end = claim->end = end;
+    ring->claimed = end;
+    list_add_tail(&claim->link, &ring->claims);
+}
+
+/*
+ * Finishes a claim whose bytes were copied up to end. What wasn't copied goes back if no
+ * one claimed anything behind it, otherwise it is lost with the claim; a range handed down
+ * by a later claim was read already and never goes back. The oldest claim
+ * moves head, a later one hands its range to the claim before it. Returns head.
+ */
+static u64 reserve_commit(struct buffer *ring, struct dm510_claim *claim, u64 end) {
+    u64 head;
+
+    spin_lock(&ring->reserve_lock);
+    if (end < claim->own_end && ring->claimed == claim->own_end && claim->end == claim->own_end)
+        ring->claimed = claim->end = end;
+    if (claim->link.prev == &ring->claims)
+        smp_store_release(&ring->ctrl->head, claim->end);
+    else
+        list_prev_entry(claim, link)->end = claim->end;
+    list_del(&claim->link);
+    head = ring_head(ring);
+    spin_unlock(&ring->reserve_lock);
+    return head;
+}
+
+/*
+ * Drops the oldest bytes of an overwrite buffer until need bytes are free at tail, whole
+ * messages at a time in message mode. A reader may be moving head at the same time, so
+ * head only moves by exchange; what the writer moved it past is counted as lost.
+ */
+static void overwrite_reclaim(struct buffer *ring, u64 tail, size_t need) {
+    u64 target = tail + need - ring->size, head = ring_head(ring), next;
+    long len;
+
+    while (head < target) {
+        next = target;
+        if (ring->messages) {
+            // The writer wrote the headers itself, and they stay put until it overwrites them
+            len = message_peek(ring, head, tail - head);
+            if (len >= 0)
+                next = head + DM510_MSG_HEADER + len;
+        }
+        if (try_cmpxchg(&ring->ctrl->head, &head, next)) {
+            atomic64_add(next - head, &ring->overwritten);
+            head = next;
+        }
+    }
+    if (ring->stamps)
+        residency_consume(ring, NULL, head); // Nobody read those
+}
+
+// Counts a finished read() or write() on the device
+static void dm510_account(struct dm510_device *dev, bool reading, size_t count, ssize_t ret) {
+    dev_stat_add(dev, reading ? DM510_STAT_READ_CALLS : DM510_STAT_WRITE_CALLS, 1);
+    if (ret > 0) {
+        dev_stat_add(dev, reading ? DM510_STAT_READ_BYTES : DM510_STAT_WRITE_BYTES, ret);
+        if (ret < count)
+            dev_stat_add(dev, reading ? DM510_STAT_SHORT_READS : DM510_STAT_SHORT_WRITES, 1);
+    } else if (ret == -EAGAIN) {
+        dev_stat_add(dev, reading ? DM510_STAT_READ_EAGAIN : DM510_STAT_WRITE_EAGAIN, 1);
+    }
+}
+
+/*
+ * One pass of read()/readv() and io_uring reads, see dm510_read_iter(). The iov_iter is filled from
+ * the buffer under one entry, wrapping around the end of a ring at most once.
+ * IOCB_NOWAIT callers get -EAGAIN instead of sleeping on data or on the buffer locks.
+ * Blocking reads hold out for the file's read watermark, until the writer goes away or
+ * the coalescing delay runs out; in message mode they wait for a whole message instead.
+ * Readers sharing a ring claim their bytes under a spinlock and copy them without it.
+ * A lone reader of an empty ring parks with its pages offered to the writer, see direct_read().
+ * In broadcast mode the read starts at the file's own cursor and the space is handed back
+ * to the writer once the slowest reader is past it. Multi-writer buffers hand out whole
+ * records from the per-CPU rings and take any record as enough.
+ */
+static ssize_t dm510_read_once(struct kiocb *iocb, struct iov_iter *to, struct mutex **exclusive) {
+    struct file *filp = iocb->ki_filp;
+    struct dm510_file *file = filp->private_data;
+    struct buffer *ring = file->dev->read_buffer;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    bool nonblock = nowait || (filp->f_flags & O_NONBLOCK);
+    size_t count = iov_iter_count(to);
+    size_t available, need, consumed, skip, copied;
+    bool locked, reserve, direct, expired = false;
+    struct dm510_claim claim;
+    struct mutex *side;
+    u64 expected, committed = 0, start;
+    ktime_t deadline = 0;
+    ssize_t ret;
+    u64 head;
+    int err;
+
+    if (!count)
+        return 0;
+
+retry:
+    for (;;) {
+        err = buffer_enter(ring, file->dev, true, nowait, &locked);
+        if (err)
+            return err;
+        if (ring->subrings) {
+            start = hist_start();
+            ret = subring_read(ring, file, to);
+            hist_record(file->dev, DM510_HIST_READ_COPY, start);
+            buffer_exit(ring, locked);
+            if (ret != -EAGAIN) {
+                if (ret > 0)
+                    buffer_wake_writers(ring, 0);
+                return ret;
+            }
+            if (nonblock)
+                return -EAGAIN;
+            err = buffer_sleep(ring, file, true, 1, 0);
+            if (err)
+                return err;
+            continue;
+        }
+        // A claimed cursor stays put, the writer can't skip this reader while it copies;
+        // readers sharing a ring claim their bytes under reserve_lock, held until they do
+        reserve = buffer_reserving(ring);
+        // Everyone else moves head, or a broadcast reader its cursor, on their own: one call at a time
+        side = ring->broadcast ? &file->lock : &ring->consumer;
+        if (!reserve && !locked && *exclusive != side) {
+            buffer_exit(ring, locked);
+            if (*exclusive)
+                mutex_unlock(*exclusive); // Taken before the broadcast mode changed
+            *exclusive = NULL;
+            err = buffer_side_lock(file->dev, side, true, nonblock);
+            if (err)
+                return err;
+            *exclusive = side;
+            continue;
+        }
+        if (ring->broadcast) {
+            head = broadcast_claim(ring, file);
+        } else if (reserve) {
+            spin_lock(&ring->reserve_lock);
+            head = reserve_start(ring);
+        } else {
+            head = ring_head(ring);
+        }
+        available = buffer_used(ring, head);
+        if (ring->messages)
+            need = DM510_MSG_HEADER; // A header means a whole message
+        else
+            // A full read waits for all of it, or as much as the ring holds
+            need = expired ? 1 : buffer_need(ring, file->full_read ? SIZE_MAX : file->read_lowat, count);
+        if (available && (available >= need || nonblock || !buffer_has_writer(ring)))
+            break;
+        direct = !available && !nonblock && need == 1 && user_backed_iter(to) && direct_eligible(ring);
+        // Not enough yet, let go of the buffer before going to sleep
+        if (ring->broadcast)
+            broadcast_commit(ring, file, head);
+        if (reserve)
+            spin_unlock(&ring->reserve_lock);
+        buffer_exit(ring, locked);
+        if (nonblock) {
+            return -EAGAIN; // If non-blocking mode, return immediately
+        }
+        if (direct) {
+            ret = direct_read(ring, file, to);
+            if (ret)
+                return ret;
+            continue; // Nothing handed over, the bytes are in the ring
+        }
+        // The coalescing delay bounds the wait for more than a byte, counted from the first sleep
+        if (need > 1 && file->coalesce && !deadline)
+            deadline = ktime_add(ktime_get(), file->coalesce);
+        err = buffer_sleep(ring, file, true, need, need > 1 ? deadline : 0);
+        if (err == -ETIME)
+            expired = true; // Settle for whatever is there
+        else if (err)
+            return err; // Wait for data to be written
+    }
+
+    if (ring->messages) {
+        ret = message_span(ring, file->batch, head, available, count, &skip);
+    } else {
+        skip = 0;
+        ret = min(count, available);
+    }
+    if (reserve) {
+        if (ret >= 0)
+            reserve_claim(ring, &claim, head + skip + ret);
+        spin_unlock(&ring->reserve_lock);
+    }
+    consumed = 0;
+    if (ret >= 0) {
+        // Messages go whole or not at all, a byte stream takes what made it
+        start = hist_start();
+        copied = buffer_copy_to_iter(ring, head + skip, ret, to);
+        hist_record(file->dev, DM510_HIST_READ_COPY, start);
+        if (ring->messages ? copied != ret : !copied) {
+            ret = -EFAULT;
+        } else {
+            ret = copied;
+            consumed = skip + copied;
+        }
+        if (reserve)
+            committed = reserve_commit(ring, &claim, head + consumed);
+    }
+    // In overwrite mode the writer may have taken these bytes back while we copied them,
+    // then head has moved on and the read starts over from there
+    if (ring->overwrite) {
+        expected = head;
+        if (!try_cmpxchg(&ring->ctrl->head, &expected, head + consumed)) {
+            iov_iter_revert(to, count - iov_iter_count(to));
+            buffer_exit(ring, locked);
+            goto retry;
+        }
+    }
+    if (ret < 0) {
+        if (ring->broadcast)
+            broadcast_commit(ring, file, head);
+        buffer_exit(ring, locked);
+        return ret;
+    }
+
+    // Hand the space back to the writer only after the bytes have been copied out
+    if (ring->broadcast) {
+        head = broadcast_commit(ring, file, head + consumed);
+    } else if (reserve) {
+        head = committed;
+    } else {
+        head += consumed;
+        if (!ring->overwrite) // Already moved by the exchange
+            smp_store_release(&ring->ctrl->head, head);
+    }
+    if (ring->elastic_limit)
+        elastic_trim(ring, head);
+    if (ring->stamps)
+        residency_consume(ring, file->dev, ring_head(ring));
+    buffer_exit(ring, locked);
+
+    buffer_wake_writers(ring, head); // Wake up waiting writers if enough space has been freed up
+    if (consumed < available && !ring->broadcast)
+        buffer_hand_out(ring, true, false); // Leftovers go to the next reader in line
+    return ret;
+}
+
+/*
+ * read()/readv() and io_uring all come through here. A blocking read on a file in full
+ * read mode goes on until the whole iov_iter is filled, or until the writer is gone and
+ * the ring drained; a signal or error after some bytes returns those bytes. Messages and
+ * records are one per read either way.
+ */
+static ssize_t dm510_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct file *filp = iocb->ki_filp;
+    struct dm510_file *file = filp->private_data;
+    struct buffer *ring = file->dev->read_buffer;
+    size_t count = iov_iter_count(to);
+    ssize_t ret = 0, done = 0;
+    struct mutex *exclusive = NULL; // The consumer mutex, or the file's in broadcast mode, taken by dm510_read_once()
+
+    trace_dm510_read_enter(file->dev - device, ring, count);
+    if (!file->full_read || (iocb->ki_flags & IOCB_NOWAIT) || (filp->f_flags & O_NONBLOCK) ||
+        READ_ONCE(ring->messages) || READ_ONCE(ring->subrings)) {
+        ret = dm510_read_once(iocb, to, &exclusive);
+    } else {
+        while (iov_iter_count(to)) {
+            if (done && !buffer_has_writer(ring) && !buffer_readable(ring, file, 1, false))
+                break; // Nothing more is coming
+            ret = dm510_read_once(iocb, to, &exclusive);
+            if (ret <= 0)
+                break;
+            done += ret;
+        }
+        if (done)
+            ret = done;
+    }
+    if (exclusive)
+        mutex_unlock(exclusive);
+    dm510_account(file->dev, true, count, ret);
+    trace_dm510_read_exit(file->dev - device, ring, count, ret);
+    return ret;
+}
+
+/*
+ * One pass of write()/writev() and io_uring writes, see dm510_write_iter(), draining the
+ * iov_iter into the buffer under one entry. dm510_open admits one writer per device, and calls on
+ * its file (io_uring may run several at once on its workers) take turns on the producer mutex.
+ * In message mode the write goes in whole, as one message, or not at all.
+ * A DM510_BROADCAST_SKIP buffer makes room by moving lagging readers ahead instead of waiting.
+ * In multi-writer mode there can be many writers, each write going in whole as one record
+ * of the ring of the CPU it runs on. In overwrite mode the write never waits for readers,
+ * the oldest bytes make room for it instead. A reader parked on an empty ring gets the
+ * start of the write copied straight into its pages, see direct_write().
+ */
+static ssize_t dm510_write_once(struct kiocb *iocb, struct iov_iter *from, bool *exclusive) {
+    struct file *filp = iocb->ki_filp;
+    struct dm510_file *file = filp->private_data;
+    struct buffer *ring = file->dev->write_buffer;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    bool nonblock = nowait || (filp->f_flags & O_NONBLOCK);
+    size_t count = iov_iter_count(from);
+    size_t space_available, need, produced, handed = 0;
+    ssize_t ret;
+    u64 tail, start;
+    bool locked;
+    int err;
+
+    if (!count)
+        return 0;
+
+    for (;;) {
+        err = buffer_enter(ring, file->dev, false, nowait, &locked);
+        if (err)
+            return err;
+        if (ring->subrings) {
+            start = hist_start();
+            ret = subring_write(ring, from, count, nowait);
+            hist_record(file->dev, DM510_HIST_WRITE_COPY, start);
+            buffer_exit(ring, locked);
+            if (ret != -ENOSPC) {
+                if (ret > 0)
+                    buffer_wake_readers(ring, 0);
+                return ret;
+            }
+            if (nonblock)
+                return -EAGAIN;
+            if (buffer_sleep(ring, file, false, record_size(count), 0))
+                return -ERESTARTSYS;
+            continue;
+        }
+        // Per-CPU rings have locks of their own, other producers outside sem go one call at a time
+        if (!locked && !*exclusive) {
+            buffer_exit(ring, locked);
+            err = buffer_side_lock(file->dev, &ring->producer, false, nonblock);
+            if (err)
+                return err;
+            *exclusive = true;
+            continue;
+        }
+        // A reader parked on the empty ring takes the first bytes straight into its pages,
+        // the rest then fits the empty ring without waiting
+        if (!handed && !nowait && READ_ONCE(ring->direct) && direct_eligible(ring)) {
+            start = hist_start();
+            handed = direct_write(ring, from);
+            hist_record(file->dev, DM510_HIST_WRITE_COPY, start);
+            count = iov_iter_count(from);
+            if (!count) {
+                buffer_exit(ring, locked);
+                return handed;
+            }
+        }
+        tail = ring_tail(ring);
+        space_available = buffer_free(ring, tail);
+        if (ring->messages) {
+            need = DM510_MSG_HEADER + count;
+            if (count > U32_MAX || need > ring->size) {
+                buffer_exit(ring, locked);
+                return -EMSGSIZE; // Would never fit
+            }
+        } else if (ring->overwrite) {
+            need = min_t(u64, count, ring->size); // As much as fits, room is made for it below
+        } else {
+            need = buffer_need(ring, file->write_lowat, count);
+        }
+        if (space_available < need && ring->broadcast == DM510_BROADCAST_SKIP) {
+            u64 head = broadcast_skip(ring, tail + need - ring->size);
+
+            if (ring->elastic_limit)
+                elastic_trim(ring, head); // The writer holds sem on elastic buffers
+            space_available = buffer_free(ring, tail);
+        }
+        if (space_available < need && ring->overwrite) {
+            overwrite_reclaim(ring, tail, need);
+            space_available = buffer_free(ring, tail);
+        }
+        if (space_available >= need || (space_available && nonblock && !ring->messages))
+            break;
+        buffer_exit(ring, locked);
+        if (nonblock) {
+            return -EAGAIN; // Non-blocking operation should return immediately
+        }
+        // For blocking I/O, wait in line until the write watermark worth of space is free
+        if (buffer_sleep(ring, file, false, need, 0)) {
+            // If the wait is interrupted by a signal, return -ERESTARTSYS
+            return -ERESTARTSYS;
+        }
+    }
+
+    // Limit write size to available space in the buffer to prevent overwrite
+    produced = ring->messages ? need : min(count, space_available);
+    // An elastic buffer only has pages for what is buffered, add the ones this write needs
+    if (ring->elastic_limit) {
+        size_t reserved = elastic_reserve(ring, tail, produced);
+
+        if (!reserved || (ring->messages && reserved < produced)) {
+            buffer_exit(ring, locked);
+            return -ENOMEM;
+        }
+        produced = reserved;
+    }
+
+    start = hist_start();
+    if (ring->messages) {
+        ret = message_write(ring, tail, count, from);
+    } else {
+        ret = produced = buffer_copy_from_iter(ring, tail, produced, from);
+        if (!ret)
+            ret = -EFAULT;
+    }
+    hist_record(file->dev, DM510_HIST_WRITE_COPY, start);
+    if (ret < 0) {
+        buffer_exit(ring, locked);
+        return handed ? handed : ret;
+    }
 
+    // Publish the new bytes to the readers, stamped first so a reader never sees them unstamped
+    if (ring->stamps)
+        residency_stamp(ring, tail + produced);
+    smp_store_release(&ring->ctrl->tail, tail + produced);
+    dev_stat_peak(file->dev, tail + produced - ring_head(ring));
+    buffer_exit(ring, locked);
 
-static int dm510_release(struct inode *inode, struct file *filp) {
-    struct dm510_device *dev = filp->private_data;
+    // Wake up readers waiting for this much data
+    buffer_wake_readers(ring, tail + produced);
+    if (produced < space_available)
+        buffer_hand_out(ring, false, false); // Room left for the next writer in line
+    return handed + ret;
+}
 
+/*
+ * write()/writev() and io_uring all come through here. A blocking write on a file in
+ * full write mode sleeps for space as often as it takes to store the whole iov_iter;
+ * a signal or error after some bytes returns those bytes.
+ */
+static ssize_t dm510_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct file *filp = iocb->ki_filp;
+    struct dm510_file *file = filp->private_data;
+    size_t count = iov_iter_count(from);
+    ssize_t ret = 0, done = 0;
+    bool exclusive = false; // Holding the producer mutex, taken by dm510_write_once() where needed
 
-    down(&shared_buffer.sem);
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY || (filp->f_flags & O_ACCMODE) == O_RDWR) {
-        dev->nwriters--;
+    trace_dm510_write_enter(file->dev - device, file->dev->write_buffer, count);
+    if (!file->full_write || (iocb->ki_flags & IOCB_NOWAIT) || (filp->f_flags & O_NONBLOCK)) {
+        ret = dm510_write_once(iocb, from, &exclusive);
+    } else {
+        while (iov_iter_count(from)) {
+            ret = dm510_write_once(iocb, from, &exclusive);
+            if (ret <= 0)
+                break;
+            done += ret;
+        }
+        if (done)
+            ret = done;
     }
-    if ((filp->f_flags & O_ACCMODE) == O_RDONLY || (filp->f_flags & O_ACCMODE) == O_RDWR) {
-        dev->nreaders--;
+    if (exclusive)
+        mutex_unlock(&file->dev->write_buffer->producer);
+    dm510_account(file->dev, false, count, ret);
+    trace_dm510_write_exit(file->dev - device, file->dev->write_buffer, count, ret);
+    return ret;
+}
+
+// Switches an empty buffer between a byte stream and messages
+static int buffer_set_messages(struct buffer *ring, bool messages) {
+    int err = 0;
+
+    percpu_down_write(&ring->gate); // Wait for transfers in flight, keep new ones out
+    if (ring->messages != messages) {
+        if (buffer_used(ring, ring_head(ring)))
+            err = -EBUSY; // Bytes or records of the old format are still waiting to be read
+        else if (messages && ring->broadcast == DM510_BROADCAST_SKIP)
+            err = -EINVAL; // Skipping would leave readers in the middle of a message
+        else
+            ring->messages = messages;
     }
-    up(&shared_buffer.sem);
-    return 0;
+    percpu_up_write(&ring->gate);
+    return err;
 }
 
+static void subrings_free(struct dm510_subring __percpu *subrings) {
+    int cpu;
 
-ssize_t dm510_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
-    struct dm510_device *dev = filp->private_data;
-    struct buffer *shared_buf = dev->shared_buffer;
+    if (!subrings)
+        return;
+    for_each_possible_cpu(cpu)
+        vfree(per_cpu_ptr(subrings, cpu)->data);
+    free_percpu(subrings);
+}
 
-    if (down_interruptible(&shared_buf->sem))
-        return -ERESTARTSYS;
+// One ring of the given size per possible CPU, each from that CPU's node
+static struct dm510_subring __percpu *subrings_alloc(u64 size) {
+    struct dm510_subring __percpu *subrings = alloc_percpu(struct dm510_subring);
+    struct dm510_subring *sub;
+    int cpu;
 
-    while (shared_buf->head == shared_buf->tail) { // Buffer is empty
-        up(&shared_buf->sem); // Release the semaphore to allow writers to proceed
-        if (filp->f_flags & O_NONBLOCK) {
-            return -EAGAIN; // If non-blocking mode, return immediately
+    if (!subrings)
+        return NULL;
+    for_each_possible_cpu(cpu) {
+        sub = per_cpu_ptr(subrings, cpu);
+        mutex_init(&sub->lock);
+        sub->size = size;
+        sub->data = vmalloc_node(size, cpu_to_node(cpu));
+        if (!sub->data) {
+            subrings_free(subrings);
+            return NULL;
         }
-        if (wait_event_interruptible(shared_buf->read_queue, shared_buf->head != shared_buf->tail))
-            return -ERESTARTSYS; // Wait for data to be written
-        if (down_interruptible(&shared_buf->sem))
-            return -ERESTARTSYS;
     }
+    return subrings;
+}
+
+/*
+ * Switches the buffer a device writes into between one writer and per-CPU rings for any
+ * number of writers (DM510_WRITERS_*). Per-CPU rings get the buffer's size each. Going to
+ * per-CPU rings needs an empty, unmapped fixed ring without broadcast readers or residency
+ * tracking; going back
+ * needs the per-CPU rings drained and at most one writer left. Switching between ordered
+ * and unordered also needs them drained, as the sequence numbers start over.
+ */
+static int buffer_set_writers(struct dm510_device *dev, int mode) {
+    struct buffer *ring = dev->write_buffer;
+    struct dm510_subring __percpu *subrings = NULL, *old = NULL;
+    int err = 0;
+
+    if (mode < DM510_WRITERS_SINGLE || mode > DM510_WRITERS_ORDERED)
+        return -EINVAL;
+    if (mode != DM510_WRITERS_SINGLE) {
+        subrings = subrings_alloc(READ_ONCE(ring->size));
+        if (!subrings)
+            return -ENOMEM;
+    }
+    if (down_interruptible(&dev->sem)) { // Keeps the number of writers still
+        subrings_free(subrings);
+        return -ERESTARTSYS;
+    }
+    percpu_down_write(&ring->gate); // Wait for transfers in flight, keep new ones out
+    if (ring->subrings && mode != DM510_WRITERS_SINGLE && ring->ordered == (mode == DM510_WRITERS_ORDERED)) {
+        // Already there
+    } else if (ring->subrings && subrings_used(ring->subrings)) {
+        err = -EBUSY; // Records still waiting to be read
+    } else if (mode == DM510_WRITERS_SINGLE) {
+        if (dev->nwriters > 1)
+            err = -EBUSY; // Only one of them could stay
+        else
+            swap(ring->subrings, old);
+    } else if (!ring->subrings && (atomic_read(&ring->mapped) || ring_tail(ring) != ring_head(ring))) {
+        err = -EBUSY; // Mapped, or still holding bytes of the one writer
+    } else if (!ring->subrings && (ring->elastic_limit || ring->broadcast || ring->overwrite || ring->stamps)) {
+        err = -EINVAL;
+    } else {
+        if (!ring->subrings)
+            swap(ring->subrings, subrings);
+        ring->ordered = mode == DM510_WRITERS_ORDERED;
+        atomic64_set(&ring->seq, 0);
+        ring->next_seq = 1;
+        ring->next_cpu = 0;
+        ring->partial = NULL;
+    }
+    percpu_up_write(&ring->gate);
+    up(&dev->sem);
+
+    subrings_free(subrings); // Not needed after all
+    if (old) {
+        synchronize_rcu(); // Let wait conditions still looking at the per-CPU rings finish
+        subrings_free(old);
+    }
+    if (!err) {
+        // Sleepers marked for the other layout, have them look again
+        buffer_wake_readers(ring, U64_MAX);
+        buffer_wake_writers(ring, U64_MAX);
+    }
+    return err;
+}
 
-    // Calculate the amount of readable data
-    size_t available = (shared_buf->tail > shared_buf->head) ? (shared_buf->tail - shared_buf->head) : (shared_buf->size - shared_buf->head + shared_buf->tail);
-    count = min(count, available);
+/*
+ * Turns overwrite mode on or off. A mapped consumer stores head without an exchange, and
+ * elastic, broadcast and per-CPU buffers have head moved by other rules, so those can't.
+ */
+static int buffer_set_overwrite(struct buffer *ring, bool overwrite) {
+    int err = 0;
 
-    size_t first_part_size = min(count, (size_t)(shared_buf->size - shared_buf->head)); // Cast to size_t
+    percpu_down_write(&ring->gate); // Wait for transfers in flight, keep new ones out
+    if (overwrite && atomic_read(&ring->mapped))
+        err = -EBUSY;
+    else if (overwrite && (ring->elastic_limit || ring->broadcast || ring->subrings))
+        err = -EINVAL;
+    else
+        ring->overwrite = overwrite;
+    percpu_up_write(&ring->gate);
+    if (!err && overwrite)
+        buffer_wake_writers(ring, U64_MAX); // Blocked writers don't have to wait any more
+    return err;
+}
 
-    if (copy_to_user(buf, shared_buf->data + shared_buf->head, first_part_size)) {
-        up(&shared_buf->sem);
-        return -EFAULT;
+/*
+ * Turns residency tracking on or off. Bytes already in the buffer when it goes on aren't
+ * timed. Per-CPU rings have no single tail to stamp, so those can't.
+ */
+static int buffer_set_residency(struct buffer *ring, bool on) {
+    struct dm510_stamp *stamps = NULL;
+    int err = 0;
+
+    if (on) {
+        stamps = kmalloc_array(RESIDENCY_STAMPS, sizeof(*stamps), GFP_KERNEL);
+        if (!stamps)
+            return -ENOMEM;
+    }
+    percpu_down_write(&ring->gate); // Wait for transfers in flight, keep new ones out
+    if (on && ring->subrings) {
+        err = -EINVAL;
+    } else if (on != !!ring->stamps) {
+        swap(ring->stamps, stamps);
+        ring->first_stamp = ring->nr_stamps = 0;
     }
+    percpu_up_write(&ring->gate);
+    kfree(stamps); // The old stamps, or the new ones if not needed
+    return err;
+}
+
+/*
+ * Turns broadcast mode on or off. Turning it on starts every reader at head, turning it off
+ * leaves the shared head at the slowest reader, so the others see some bytes again.
+ */
+static int buffer_set_broadcast(struct buffer *ring, int broadcast) {
+    struct dm510_file *reader;
+    int err = 0;
 
-    // If data wraps around to the beginning of the buffer
-    if (count > first_part_size) {
-        if (copy_to_user(buf + first_part_size, shared_buf->data, count - first_part_size)) {
-            up(&shared_buf->sem);
-            return -EFAULT;
+    if (broadcast < DM510_BROADCAST_OFF || broadcast > DM510_BROADCAST_SKIP)
+        return -EINVAL;
+    percpu_down_write(&ring->gate); // Wait for transfers in flight, keep new ones out
+    if (broadcast && atomic_read(&ring->mapped)) {
+        err = -EBUSY; // A mapped consumer moves head itself, there is no cursor to follow
+    } else if (broadcast && (ring->subrings || ring->overwrite)) {
+        err = -EINVAL; // Records of per-CPU rings go to one reader each, overwriting has its own head
+    } else if (broadcast == DM510_BROADCAST_SKIP && ring->messages) {
+        err = -EINVAL; // Skipping would leave readers in the middle of a message
+    } else {
+        spin_lock(&ring->readers_lock);
+        if (broadcast && !ring->broadcast) {
+            list_for_each_entry(reader, &ring->readers, reader_link)
+                reader->cursor = ring_head(ring);
         }
+        ring->broadcast = broadcast;
+        spin_unlock(&ring->readers_lock);
     }
+    percpu_up_write(&ring->gate);
+    return err;
+}
 
-    // Update head pointer with wrap around
-    shared_buf->head = (shared_buf->head + count) % shared_buf->size;
+// Allocates a zeroed control page for a buffer of the given size
+static struct dm510_ring_ctrl *buffer_ctrl_alloc(u64 size) {
+    struct dm510_ring_ctrl *ctrl = (struct dm510_ring_ctrl *)get_zeroed_page(GFP_KERNEL_ACCOUNT);
 
-    wake_up_interruptible(&shared_buf->write_queue); // Wake up waiting writers if space has been freed up
+    if (ctrl)
+        ctrl->size = size;
+    return ctrl;
+}
 
-    up(&shared_buf->sem);
-    return count;
+/*
+ * Allocates zeroed data pages for a ring of the given size. They come from vmalloc, so
+ * large rings don't need physically contiguous memory, and vmalloc_huge() backs them with
+ * huge pages where the architecture supports it. Keeping the control page out of this
+ * allocation keeps it from spilling into one more huge page.
+ */
+static char *buffer_data_alloc(u64 size) {
+    return vmalloc_huge(PAGE_ALIGN(size), GFP_KERNEL_ACCOUNT | __GFP_ZERO | __GFP_NOWARN);
 }
 
-ssize_t dm510_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
-    struct dm510_device *dev = filp->private_data;
-    struct buffer *shared_buf = dev->shared_buffer;
+static void buffer_storage_free(struct dm510_ring_ctrl *ctrl, char *data) {
+    free_page((unsigned long)ctrl);
+    vfree(data);
+}
 
-    if (down_interruptible(&shared_buf->sem))
-        return -ERESTARTSYS;
+// Copies the bytes at counters [from, to) into another data area, each to its offset under that area's mask
+static void buffer_migrate(char *dst, u64 dst_size, struct buffer *src, u64 from, u64 to) {
+    while (from < to) {
+        size_t src_offset = from & (src->size - 1);
+        size_t dst_offset = from & (dst_size - 1);
+        size_t chunk = min_t(u64, to - from, min(src->size - src_offset, dst_size - dst_offset));
 
-    size_t space_available = (shared_buf->head > shared_buf->tail) ? 
-                             (shared_buf->head - shared_buf->tail - 1) : 
-                             (shared_buf->size - shared_buf->tail + shared_buf->head - 1);
+        memcpy(dst + dst_offset, src->data + src_offset, chunk);
+        from += chunk;
+        cond_resched(); // Rings can be gigabytes
+    }
+}
 
-    while (space_available == 0) { // Changed to while for reevaluation after wake up
-        if (filp->f_flags & O_NONBLOCK) {
-            up(&shared_buf->sem); // Release the semaphore before returning
-            return -EAGAIN; // Non-blocking operation should return immediately
-        }
-        // For blocking I/O, wait until there is space in the buffer
-        up(&shared_buf->sem); // Release the semaphore before going to sleep
+/*
+ * Moves a buffer to storage of another size without losing what is buffered. The bytes
+ * buffered at the start are copied while readers and the writer keep going; the writer
+ * only fills slots of bytes that have been read, and those no longer matter. Transfers
+ * are then held off just long enough to copy what was written meanwhile and swap the
+ * storage. The counters carry over, so the stream continues where it was.
+ */
+static int buffer_resize(struct buffer *ring, u64 new_size) {
+    struct dm510_ring_ctrl *new_ctrl = buffer_ctrl_alloc(new_size);
+    char *new_data = buffer_data_alloc(new_size);
+    u64 head, tail, snapshot;
+    int err = 0;
 
-        if (wait_event_interruptible(shared_buf->write_queue,
-            (shared_buf->head > shared_buf->tail) ? 
-            (shared_buf->head - shared_buf->tail - 1) : 
-            (shared_buf->size - shared_buf->tail + shared_buf->head - 1) > 0)) {
-            // If the wait is interrupted by a signal, return -ERESTARTSYS
-            return -ERESTARTSYS;
-        }
+    if (!new_ctrl || !new_data) {
+        buffer_storage_free(new_ctrl, new_data);
+        return -ENOMEM;
+    }
+    if (mutex_lock_interruptible(&ring->resize_lock)) {
+        buffer_storage_free(new_ctrl, new_data);
+        return -ERESTARTSYS;
+    }
+    if (ring->elastic_limit || ring->subrings) {
+        // Elastic buffers have a ceiling instead, set with SET_BUFFER_ELASTIC, and per-CPU rings keep their size
+        mutex_unlock(&ring->resize_lock);
+        buffer_storage_free(new_ctrl, new_data);
+        return -EBUSY;
+    }
 
-        if (down_interruptible(&shared_buf->sem))
-            return -ERESTARTSYS;
-        
-        // Recalculate space_available after waking up
-        space_available = (shared_buf->head > shared_buf->tail) ? 
-                          (shared_buf->head - shared_buf->tail - 1) : 
-                          (shared_buf->size - shared_buf->tail + shared_buf->head - 1);
+    head = ring_head(ring);
+    snapshot = ring_tail(ring);
+    if (snapshot - head <= new_size)
+        buffer_migrate(new_data, new_size, ring, head, snapshot);
+    else
+        snapshot = head; // Doesn't fit for now, try again under the gate
+
+    percpu_down_write(&ring->gate); // Wait for transfers in flight, keep new ones out
+    if (atomic_read(&ring->mapped)) {
+        err = -EBUSY; // User space still has the old pages mapped
+        goto unlock;
+    }
+    head = ring_head(ring);
+    tail = ring_tail(ring);
+    if (tail - head > new_size) {
+        err = -ENOSPC; // Can't shrink below the bytes waiting to be read
+        goto unlock;
     }
+    buffer_migrate(new_data, new_size, ring, max(head, snapshot), tail);
+    new_ctrl->head = head;
+    new_ctrl->tail = tail;
+    swap(ring->ctrl, new_ctrl); // The old storage is freed below
+    swap(ring->data, new_data);
+    ring->size = new_size;
+unlock:
+    percpu_up_write(&ring->gate);
+    mutex_unlock(&ring->resize_lock);
 
-    // Limit write size to available space in the buffer to prevent overwrite
-    count = min(count, space_available);
+    if (!err) {
+        synchronize_rcu(); // Let wait conditions still looking at the old storage finish
+        buffer_wake_writers(ring, U64_MAX); // There may be more room now
+    }
+    buffer_storage_free(new_ctrl, new_data);
+    return err;
+}
 
-    size_t first_part_size = min(count, (size_t)(shared_buf->size - shared_buf->tail)); // Cast to size_t
-    if (copy_from_user(shared_buf->data + shared_buf->tail, buf, first_part_size)) {
-        up(&shared_buf->sem);
-        return -EFAULT;
+/*
+ * Turns an empty ring into an elastic buffer with the given ceiling, moves the ceiling of
+ * an elastic buffer, or with a limit of 0 turns an empty elastic buffer back into a fixed
+ * BUFFER_SIZE ring. The counters carry over either way.
+ */
+static int buffer_set_elastic(struct buffer *ring, u64 limit) {
+    struct dm510_ring_ctrl *new_ctrl;
+    char *new_data = NULL; // Elastic buffers keep their bytes in the page chain
+    u64 head, tail;
+    int err = 0;
+
+    if (limit && (limit < PAGE_SIZE || limit > max_buffer_size || READ_ONCE(ring->overwrite)))
+        return -EINVAL;
+    new_ctrl = buffer_ctrl_alloc(limit ? limit : BUFFER_SIZE);
+    if (!limit)
+        new_data = buffer_data_alloc(BUFFER_SIZE);
+    if (!new_ctrl || (!limit && !new_data)) {
+        buffer_storage_free(new_ctrl, new_data);
+        return -ENOMEM;
+    }
+    if (mutex_lock_interruptible(&ring->resize_lock)) {
+        buffer_storage_free(new_ctrl, new_data);
+        return -ERESTARTSYS;
     }
 
-    // If data wraps around to the beginning of the buffer
-    if (count > first_part_size) {
-        if (copy_from_user(shared_buf->data, buf + first_part_size, count - first_part_size)) {
-            up(&shared_buf->sem);
-            return -EFAULT;
+    percpu_down_write(&ring->gate); // Wait for transfers in flight, keep new ones out
+    down(&ring->sem);               // and the shrinker off the page lists
+    head = ring_head(ring);
+    tail = ring_tail(ring);
+    if (limit && ring->elastic_limit) {
+        // Only the ceiling moves, the pages stay where they are
+        if (tail - head > limit) {
+            err = -ENOSPC; // Can't go below the bytes waiting to be read
+        } else {
+            ring->elastic_limit = limit;
+            ring->size = limit;
+            ring->ctrl->size = limit;
         }
+        goto unlock;
+    }
+    if (!limit && !ring->elastic_limit)
+        goto unlock; // Already a fixed ring
+    if (atomic_read(&ring->mapped) || tail != head || ring->subrings) {
+        err = -EBUSY; // Mapped, still holding bytes in the old layout, or in multi-writer mode
+        goto unlock;
+    }
+    new_ctrl->head = head;
+    new_ctrl->tail = tail;
+    if (limit)
+        ring->seg_base = tail; // Pages get added as the writer needs them
+    else
+        elastic_release(ring);
+    swap(ring->ctrl, new_ctrl); // The old storage is freed below
+    swap(ring->data, new_data);
+    ring->size = limit ? limit : BUFFER_SIZE;
+    ring->elastic_limit = limit;
+unlock:
+    up(&ring->sem);
+    percpu_up_write(&ring->gate);
+    mutex_unlock(&ring->resize_lock);
+
+    if (!err) {
+        synchronize_rcu(); // Let wait conditions still looking at the old storage finish
+        buffer_wake_writers(ring, U64_MAX); // There may be more room now
     }
+    buffer_storage_free(new_ctrl, new_data);
+    return err;
+}
 
-    // Update tail pointer with wrap around
-    shared_buf->tail = (shared_buf->tail + count) % shared_buf->size;
+// Rounds a requested size up to a power of two and resizes to it, leaving the applied size in *size
+static int buffer_set_size(struct buffer *ring, u64 *size, u64 limit) {
+    // Ensure minimum buffer size of 5 bytes
+    if (*size < 5 || *size > limit)
+        return -EINVAL;
+    *size = roundup_pow_of_two(*size);
+    if (*size > limit)
+        return -EINVAL;
+    return buffer_resize(ring, *size);
+}
 
-    // Wake up readers waiting for data
-    wake_up_interruptible(&shared_buf->read_queue);
+// The int commands can't express more than INT_MAX bytes of space, larger amounts saturate
+static size_t buffer_free_space(struct buffer *ring) {
+    size_t free_space;
 
-    up(&shared_buf->sem);
-    return count;
+    percpu_down_read(&ring->gate); // Keep a resize from swapping the buffer under us
+    free_space = buffer_free(ring, ring_tail(ring));
+    percpu_up_read(&ring->gate);
+    return free_space;
+}
+
+// Bytes the given reader of the buffer can still read
+static size_t buffer_used_space(struct buffer *ring, struct dm510_file *file) {
+    size_t used_space;
+
+    percpu_down_read(&ring->gate);
+    used_space = buffer_used(ring, reader_pos(ring, file));
+    percpu_up_read(&ring->gate);
+    return used_space;
+}
+
+static struct file_operations dm510_fops;
+
+/*
+ * Runs one operation of a SUBMIT_BATCH on the dm510 file behind op->fd, the way the
+ * matching read(), write() or ioctl() would, settings of that open file included.
+ * Transfers serialize on the buffer's producer and consumer mutexes like any other caller,
+ * and get the permission check and fsnotify events of vfs_read()/vfs_write(). A stream
+ * file has no position, so security_file_permission() is all rw_verify_area() would do.
+ */
+static long dm510_batch_op(struct dm510_op *op) {
+    struct dm510_file *file;
+    struct iov_iter iter;
+    struct kiocb kiocb;
+    struct fd f = fdget(op->fd);
+    bool reading = op->opcode == DM510_OP_READ;
+    long ret;
+
+    if (!f.file)
+        return -EBADF;
+    if (f.file->f_op != &dm510_fops) {
+        fdput(f);
+        return -EBADF;
+    }
+    file = f.file->private_data;
+
+    switch (op->opcode) {
+        case DM510_OP_READ:
+        case DM510_OP_WRITE:
+            if (!(f.file->f_mode & (reading ? FMODE_READ : FMODE_WRITE))) {
+                ret = -EBADF;
+                break;
+            }
+            ret = import_ubuf(reading ? ITER_DEST : ITER_SOURCE, u64_to_user_ptr(op->buf),
+                              min_t(u64, op->len, MAX_RW_COUNT), &iter);
+            if (ret)
+                break;
+            ret = security_file_permission(f.file, reading ? MAY_READ : MAY_WRITE);
+            if (ret)
+                break;
+            init_sync_kiocb(&kiocb, f.file);
+            ret = reading ? dm510_read_iter(&kiocb, &iter) : dm510_write_iter(&kiocb, &iter);
+            if (ret > 0) {
+                if (reading)
+                    fsnotify_access(f.file);
+                else
+                    fsnotify_modify(f.file);
+            }
+            break;
+        case DM510_OP_USED:
+            ret = min_t(size_t, buffer_used_space(file->dev->read_buffer, file), LONG_MAX);
+            break;
+        case DM510_OP_FREE:
+            ret = min_t(size_t, buffer_free_space(file->dev->write_buffer), LONG_MAX);
+            break;
+        default:
+            ret = -EINVAL;
+    }
+    fdput(f);
+    return ret;
+}
+
+/*
+ * SUBMIT_BATCH: runs the operations in order, each result going back into its entry.
+ * One failing doesn't stop the others, but a signal does: the interrupted operation gets
+ * -EINTR and the ones behind it are left alone. Returns how many operations ran.
+ */
+static long dm510_batch(struct dm510_batch __user *ubatch) {
+    struct dm510_batch batch;
+    struct dm510_op __user *uops;
+    struct dm510_op op;
+    unsigned int i;
+    long result;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count > DM510_BATCH_MAX)
+        return -EINVAL;
+    uops = u64_to_user_ptr(batch.ops);
+    for (i = 0; i < batch.count; i++) {
+        if (copy_from_user(&op, &uops[i], sizeof(op)))
+            return i ? i : -EFAULT;
+        result = dm510_batch_op(&op);
+        if (result == -ERESTARTSYS)
+            result = -EINTR; // Can't restart the operations that already ran
+        if (put_user((long long)result, &uops[i].result))
+            return i ? i : -EFAULT;
+        if (result == -EINTR)
+            return i + 1;
+    }
+    return i;
 }
 
+static int put_space(unsigned long arg, size_t space) {
+    int value = min_t(size_t, space, INT_MAX);
+    return copy_to_user((int __user *)arg, &value, sizeof(value)) ? -EFAULT : 0;
+}
 
 long dm510_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-    struct dm510_device *dev = filp->private_data;
+    struct dm510_file *file = filp->private_data;
+    struct dm510_device *dev = file->dev;
+    struct buffer *out = dev->write_buffer; // Buffer this device writes into
+    struct buffer *in = dev->read_buffer;   // Buffer this device reads from
     int new_size, retval = 0;
+    u64 size64, old_size;
     switch (cmd) {
         case GET_BUFFER_SIZE:
-            if (copy_to_user((int __user *)arg, &shared_buffer.size, sizeof(shared_buffer.size)))
+            size64 = READ_ONCE(out->size);
+            if (size64 > INT_MAX) {
+                retval = -EOVERFLOW; // Only GET_BUFFER_SIZE64 can report this one
+                break;
+            }
+            new_size = size64;
+            if (copy_to_user((int __user *)arg, &new_size, sizeof(new_size)))
                 retval = -EFAULT;
             break;
 	case SET_BUFFER_SIZE:
 	    if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size))) {
         	retval = -EFAULT;
-	    } else if (new_size < 5) { // Ensure minimum buffer size of 5 bytes
+	    } else if (new_size < 0) {
         	retval = -EINVAL; // Invalid buffer size
 	    } else {
-        	char *new_buffer = kzalloc(new_size * sizeof(char), GFP_KERNEL);
-        	if (!new_buffer) {
-	            retval = -ENOMEM; // Out of memory
-	        } else {
-	            down(&shared_buffer.sem); // Ensure exclusive access to the buffer
-	            //  printk(KERN_INFO "DM510: Current buffer size is %d bytes, new size is %d bytes.\n", shared_buffer.size, new_size);
-            	    kfree(shared_buffer.data); // Free old buffer
-            	    shared_buffer.data = new_buffer; // Assign new buffer
-            	    shared_buffer.size = new_size; // Update buffer size
-            	    shared_buffer.head = 0; // Reset pointers
-            	    shared_buffer.tail = 0;
-            	    up(&shared_buffer.sem); // Release the semaphore
-            	    retval = 0; // Indicate success
-        	}
+        	size64 = new_size;
+        	old_size = READ_ONCE(out->size);
+        	retval = buffer_set_size(out, &size64, min_t(u64, BUFFER_SIZE_MAX, max_buffer_size));
+        	trace_dm510_resize(dev - device, old_size, size64, retval);
+        	new_size = size64;
+        	// Report back the size actually applied
+        	if (!retval && copy_to_user((int __user *)arg, &new_size, sizeof(new_size)))
+        	    retval = -EFAULT;
     	    }
    	    break;
 
+        case GET_BUFFER_SIZE64:
+            size64 = READ_ONCE(out->size);
+            if (copy_to_user((u64 __user *)arg, &size64, sizeof(size64)))
+                retval = -EFAULT;
+            break;
+
+        case SET_BUFFER_SIZE64:
+            if (copy_from_user(&size64, (u64 __user *)arg, sizeof(size64))) {
+                retval = -EFAULT;
+                break;
+            }
+            old_size = READ_ONCE(out->size);
+            retval = buffer_set_size(out, &size64, max_buffer_size);
+            trace_dm510_resize(dev - device, old_size, size64, retval);
+            // Report back the size actually applied
+            if (!retval && copy_to_user((u64 __user *)arg, &size64, sizeof(size64)))
+                retval = -EFAULT;
+            break;
+
+        case SET_BUFFER_ELASTIC:
+            if (copy_from_user(&size64, (u64 __user *)arg, sizeof(size64)))
+                retval = -EFAULT;
+            else
+                retval = buffer_set_elastic(out, size64);
+            break;
+
        case GET_MAX_NR_PROCESSES:
            if (copy_to_user((int __user *)arg, &dev->max_processes, sizeof(dev->max_processes))) {
                retval = -EFAULT;
@@ -244,55 +2420,465 @@ long dm510_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 
         case SET_MAX_NR_PROCESSES:
             // Updating max_processes from the value provided by user space
-            if (copy_from_user(&dev->max_processes, (int __user *)arg, sizeof(dev->max_processes))) {
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size))) {
                 retval = -EFAULT;
+            } else {
+                down(&dev->sem); // Serialize with the open/release accounting
+                dev->max_processes = new_size;
+                up(&dev->sem);
+            }
+            break;
+
+        case GET_BUFFER_FREE_SPACE:
+            retval = put_space(arg, buffer_free_space(out));
+            break;
+
+        case GET_BUFFER_USED_SPACE:
+            retval = put_space(arg, buffer_used_space(in, file));
+	    break;
+
+        // A mapped producer advanced tail in place, wake the readers of the other device
+        case NOTIFY_DATA_WRITTEN:
+            percpu_down_read(&out->gate);
+            if (out->stamps)
+                residency_stamp(out, ring_tail(out));
+            percpu_up_read(&out->gate);
+            buffer_wake_readers(out, U64_MAX);
+            break;
+
+        // A mapped consumer advanced head in place, wake the writer of the other device
+        case NOTIFY_DATA_READ:
+            percpu_down_read(&in->gate);
+            if (in->stamps)
+                residency_consume(in, dev, ring_head(in));
+            percpu_up_read(&in->gate);
+            buffer_wake_writers(in, U64_MAX);
+            break;
+
+        // Sleep until the read watermark is there, then report how much like GET_BUFFER_USED_SPACE
+        case WAIT_FOR_DATA: {
+            size_t used_space, need = buffer_need(in, file->read_lowat, SIZE_MAX);
+            if (!buffer_readable(in, file, need, false) && (filp->f_flags & O_NONBLOCK)) {
+                retval = -EAGAIN;
+                break;
+            }
+            if (wait_event_interruptible(in->read_queue, buffer_readable(in, file, need, false))) {
+                retval = -ERESTARTSYS;
+                break;
+            }
+            percpu_down_read(&in->gate);
+            used_space = buffer_used(in, reader_pos(in, file));
+            percpu_up_read(&in->gate);
+            retval = put_space(arg, used_space);
+            break;
+        }
+
+        // Sleep until the write watermark is free, then report how much like GET_BUFFER_FREE_SPACE
+        case WAIT_FOR_SPACE: {
+            size_t free_space, need = buffer_need(out, file->write_lowat, SIZE_MAX);
+            if (!buffer_writable(out, need, false) && (filp->f_flags & O_NONBLOCK)) {
+                retval = -EAGAIN;
+                break;
             }
+            if (wait_event_interruptible(out->write_queue, buffer_writable(out, need, false))) {
+                retval = -ERESTARTSYS;
+                break;
+            }
+            percpu_down_read(&out->gate);
+            free_space = buffer_free(out, ring_tail(out));
+            percpu_up_read(&out->gate);
+            retval = put_space(arg, free_space);
             break;
+        }
 
-        case GET_BUFFER_FREE_SPACE: { 
-            int free_space;
-            down(&shared_buffer.sem); // Ensure exclusive access
-            if (shared_buffer.tail >= shared_buffer.head) {
-                free_space = shared_buffer.size - (shared_buffer.tail - shared_buffer.head) - 1;
+        // Watermarks and the coalescing delay belong to this open file only
+        case SET_READ_LOWAT:
+        case SET_WRITE_LOWAT:
+        case SET_COALESCE_DELAY:
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size))) {
+                retval = -EFAULT;
+            } else if (new_size < 0) {
+                retval = -EINVAL;
+            } else if (cmd == SET_COALESCE_DELAY) {
+                file->coalesce = us_to_ktime(new_size);
             } else {
-                free_space = (shared_buffer.head - shared_buffer.tail) - 1;
+                new_size = max(new_size, 1); // 0 means the default of any byte
+                if (cmd == SET_READ_LOWAT)
+                    file->read_lowat = new_size;
+                else
+                    file->write_lowat = new_size;
             }
-            up(&shared_buffer.sem);
-            if (copy_to_user((int __user *)arg, &free_space, sizeof(free_space))) {
+            break;
+
+        // Message mode belongs to the buffer this device writes into, both ends see it
+        case SET_MESSAGE_MODE:
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size)))
+                retval = -EFAULT;
+            else
+                retval = buffer_set_messages(out, new_size != 0);
+            break;
+
+        case SET_MESSAGE_BATCH:
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size)))
+                retval = -EFAULT;
+            else
+                file->batch = new_size != 0;
+            break;
+
+        case SET_FULL_TRANSFER:
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size))) {
                 retval = -EFAULT;
+            } else if (new_size & ~(DM510_FULL_READ | DM510_FULL_WRITE)) {
+                retval = -EINVAL;
+            } else {
+                file->full_read = new_size & DM510_FULL_READ;
+                file->full_write = new_size & DM510_FULL_WRITE;
+            }
+            break;
+
+        // Latency histograms of this device, summed over the CPUs
+        case GET_LATENCY_HIST: {
+            struct dm510_latency_hist *hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+
+            if (!hist) {
+                retval = -ENOMEM;
+                break;
             }
+            dm510_hist_sum(dev, hist);
+            if (copy_to_user((void __user *)arg, hist, sizeof(*hist)))
+                retval = -EFAULT;
+            kfree(hist);
+            break;
+        }
+
+        case RESET_LATENCY_HIST:
+            dm510_hist_reset(dev);
+            break;
+
+        // Operations on any number of dm510 files in one go, see dm510_batch()
+        case SUBMIT_BATCH:
+            retval = dm510_batch((struct dm510_batch __user *)arg);
             break;
-	}
 
-        case GET_BUFFER_USED_SPACE: {
-            int used_space;
-            down(&shared_buffer.sem); // Ensure exclusive access
-            if (shared_buffer.tail >= shared_buffer.head) {
-                used_space = shared_buffer.tail - shared_buffer.head;
+        // Payload length of the next message waiting in the buffer this device reads from
+        case GET_NEXT_MESSAGE_SIZE: {
+            long len;
+            percpu_down_read(&in->gate);
+            if (!in->messages) {
+                len = -EINVAL; // Only message buffers have one
+            } else if (down_interruptible(&in->sem)) {
+                len = -ERESTARTSYS;
             } else {
-                used_space = shared_buffer.size - (shared_buffer.head - shared_buffer.tail);
+                // sem keeps readers taking turns (and the elastic page chain) still while we look,
+                // reserve_lock the readers claiming their bytes instead
+                bool reserve = buffer_reserving(in);
+                u64 head;
+                size_t used;
+
+                if (reserve)
+                    spin_lock(&in->reserve_lock);
+                head = reserve ? reserve_start(in) : reader_pos(in, file);
+                used = buffer_used(in, head);
+                len = used ? message_peek(in, head, used) : -ENOMSG;
+                if (reserve)
+                    spin_unlock(&in->reserve_lock);
+                up(&in->sem);
             }
-            up(&shared_buffer.sem);
-            if (copy_to_user((int __user *)arg, &used_space, sizeof(used_space))) {
+            percpu_up_read(&in->gate);
+            retval = len < 0 ? len : put_space(arg, len);
+            break;
+        }
+
+        // Broadcast mode belongs to the buffer this device writes into, like message mode
+        case SET_BROADCAST_MODE:
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size)))
+                retval = -EFAULT;
+            else
+                retval = buffer_set_broadcast(out, new_size);
+            break;
+
+        // Writer mode of the buffer this device writes into
+        case SET_MULTI_WRITER:
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size)))
+                retval = -EFAULT;
+            else
+                retval = buffer_set_writers(dev, new_size);
+            break;
+
+        // Overwrite mode belongs to the buffer this device writes into
+        case SET_OVERWRITE_MODE:
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size)))
+                retval = -EFAULT;
+            else
+                retval = buffer_set_overwrite(out, new_size != 0);
+            break;
+
+        case SET_RESIDENCY_TRACKING:
+            if (copy_from_user(&new_size, (int __user *)arg, sizeof(new_size)))
+                retval = -EFAULT;
+            else
+                retval = buffer_set_residency(out, new_size != 0);
+            break;
+
+        // How long the oldest byte of the read buffer has been waiting for us
+        case GET_OLDEST_AGE:
+            percpu_down_read(&in->gate);
+            size64 = in->stamps ? residency_oldest(in, ring_head(in)) : 0;
+            percpu_up_read(&in->gate);
+            if (copy_to_user((u64 __user *)arg, &size64, sizeof(size64)))
                 retval = -EFAULT;
+            break;
+
+        // Bytes this open file missed because the writer skipped it, plus what an overwriting
+        // writer dropped since the last reader asked, cleared on reading
+        case GET_LOST_BYTES: {
+            unsigned long long lost = 0;
+            if (filp->f_mode & FMODE_READ) {
+                spin_lock(&in->readers_lock);
+                lost = file->lost;
+                file->lost = 0;
+                spin_unlock(&in->readers_lock);
+                lost += atomic64_xchg(&in->overwritten, 0);
             }
-	    break;
-	}
+            if (copy_to_user((unsigned long long __user *)arg, &lost, sizeof(lost)))
+                retval = -EFAULT;
+            break;
+        }
+
                 default:
                     retval = -ENOTTY;
 	   }
     	   return retval;
 }
 
+/*
+ * Readable while the buffer this device reads from holds the file's read watermark,
+ * writable while the buffer it writes into has the write watermark free. Each poll arms
+ * the wake-up marks, so the next transfer that adds data or frees space wakes the matching
+ * queue and edge-triggered epoll sees a fresh event for it.
+ */
+static __poll_t dm510_poll(struct file *filp, poll_table *wait) {
+    struct dm510_file *file = filp->private_data;
+    struct dm510_device *dev = file->dev;
+    __poll_t mask = 0;
+
+    if (filp->f_mode & FMODE_READ)
+        poll_wait(filp, &dev->read_buffer->read_queue, wait);
+    if (filp->f_mode & FMODE_WRITE)
+        poll_wait(filp, &dev->write_buffer->write_queue, wait);
+
+    if ((filp->f_mode & FMODE_READ) &&
+        buffer_readable(dev->read_buffer, file, buffer_need(dev->read_buffer, file->read_lowat, SIZE_MAX), true))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if ((filp->f_mode & FMODE_WRITE) &&
+        buffer_writable(dev->write_buffer, buffer_need(dev->write_buffer, file->write_lowat, SIZE_MAX), true))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+static void dm510_vma_open(struct vm_area_struct *vma) {
+    struct buffer *ring = vma->vm_private_data;
+    atomic_inc(&ring->mapped);
+}
+
+static void dm510_vma_close(struct vm_area_struct *vma) {
+    struct buffer *ring = vma->vm_private_data;
+    atomic_dec(&ring->mapped);
+}
+
+static const struct vm_operations_struct dm510_vm_ops = {
+    .open = dm510_vma_open,
+    .close = dm510_vma_close,
+};
+
+/*
+ * Maps the control page and the data pages of one buffer. The offset picks the buffer
+ * (see DM510_MMAP_WRITE_BUFFER/DM510_MMAP_READ_BUFFER) and the file has to be open for
+ * that direction. The mapping has to be shared, or the other side never sees it move.
+ */
+static int dm510_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct dm510_device *dev = ((struct dm510_file *)filp->private_data)->dev;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long off;
+    struct buffer *ring;
+    int err = 0;
+
+    if (vma->vm_pgoff == DM510_MMAP_WRITE_BUFFER >> PAGE_SHIFT && (filp->f_mode & FMODE_WRITE))
+        ring = dev->write_buffer;
+    else if (vma->vm_pgoff == DM510_MMAP_READ_BUFFER >> PAGE_SHIFT && (filp->f_mode & FMODE_READ))
+        ring = dev->read_buffer;
+    else
+        return -EINVAL;
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    percpu_down_read(&ring->gate); // Keep a resize from swapping the storage under us
+    // An elastic buffer's pages aren't contiguous and come and go, it can't be mapped, and
+    // broadcast readers each need a cursor the control page has no room for, and a multi-writer
+    // buffer's bytes are in the per-CPU rings. A consumer storing head would race an overwriting writer
+    if (ring->elastic_limit || ring->broadcast || ring->subrings || ring->overwrite ||
+        len > PAGE_SIZE + PAGE_ALIGN(ring->size)) {
+        err = -EINVAL;
+        goto out;
+    }
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    // The control page first, then the data pages from their own allocation
+    err = vm_insert_page(vma, vma->vm_start, virt_to_page(ring->ctrl));
+    for (off = PAGE_SIZE; off < len && !err; off += PAGE_SIZE)
+        err = vm_insert_page(vma, vma->vm_start + off, vmalloc_to_page(ring->data + off - PAGE_SIZE));
+    if (!err) {
+        vma->vm_ops = &dm510_vm_ops;
+        vma->vm_private_data = ring;
+        dm510_vma_open(vma);
+    }
+out:
+    percpu_up_read(&ring->gate);
+    return err;
+}
+
 static struct file_operations dm510_fops = {
     .owner = THIS_MODULE,
     .open = dm510_open,
     .release = dm510_release,
-    .read = dm510_read,
-    .write = dm510_write,
+    .read_iter = dm510_read_iter,
+    .write_iter = dm510_write_iter,
+    // splice()/sendfile() run the iter handlers on pipe pages, with no user space bounce. They
+    // don't take f_pos_lock, the iter handlers serialize each side of the ring themselves
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
     .unlocked_ioctl = dm510_ioctl,
+    .compat_ioctl = compat_ptr_ioctl, // Arguments are plain pointers to int or 64-bit values
+    .mmap = dm510_mmap,
+    .poll = dm510_poll,
+};
+
+static unsigned long elastic_count_spares(struct shrinker *shrink, struct shrink_control *sc) {
+    return atomic_long_read(&elastic_spare_pages);
+}
+
+static unsigned long elastic_scan_spares(struct shrinker *shrink, struct shrink_control *sc) {
+    unsigned long freed = 0;
+    int i;
+
+    for (i = 0; i < BUFFER_COUNT && freed < sc->nr_to_scan; ++i) {
+        // A writer allocating pages under sem may be what got us here, so never wait for it
+        if (down_trylock(&buffers[i].sem))
+            continue;
+        freed += elastic_free_spares(&buffers[i], sc->nr_to_scan - freed);
+        up(&buffers[i].sem);
+    }
+    return freed ? freed : SHRINK_STOP;
+}
+
+// Lets memory pressure take back the pages elastic buffers keep for their next burst
+static struct shrinker elastic_shrinker = {
+    .count_objects = elastic_count_spares,
+    .scan_objects = elastic_scan_spares,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static struct dentry *dm510_debugfs; // dm510/ in debugfs, stats and latency files per device
+
+// Upper bound in nanoseconds of the bucket holding the given per mille of the samples
+static u64 hist_percentile(const u64 *bucket, u64 total, unsigned int permille) {
+    u64 seen = 0, want = DIV_ROUND_UP(total * permille, 1000);
+    int i;
+
+    for (i = 0; i < DM510_HIST_BUCKETS - 1; i++) {
+        seen += bucket[i];
+        if (seen >= want)
+            break;
+    }
+    return 2ULL << i;
+}
+
+static const char * const dm510_hist_names[DM510_HIST_PHASES] = {
+    "read_wait", "read_lock", "read_copy", "write_wait", "write_lock", "write_copy", "residency",
+};
+
+// One line per phase: sample count and p50/p99/p999 in nanoseconds, then the raw buckets
+static int dm510_latency_show(struct seq_file *m, void *v) {
+    struct dm510_latency_hist *hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+    u64 total;
+    int phase, i;
+
+    if (!hist)
+        return -ENOMEM;
+    dm510_hist_sum(m->private, hist);
+    for (phase = 0; phase < DM510_HIST_PHASES; phase++) {
+        total = 0;
+        for (i = 0; i < DM510_HIST_BUCKETS; i++)
+            total += hist->bucket[phase][i];
+        seq_printf(m, "%s count %llu", dm510_hist_names[phase], total);
+        if (total)
+            seq_printf(m, " p50 %llu p99 %llu p999 %llu", hist_percentile(hist->bucket[phase], total, 500),
+                       hist_percentile(hist->bucket[phase], total, 990),
+                       hist_percentile(hist->bucket[phase], total, 999));
+        seq_puts(m, " buckets");
+        for (i = 0; i < DM510_HIST_BUCKETS; i++)
+            seq_printf(m, " %llu", hist->bucket[phase][i]);
+        seq_putc(m, '\n');
+    }
+    kfree(hist);
+    return 0;
+}
+
+static int dm510_latency_open(struct inode *inode, struct file *filp) {
+    return single_open(filp, dm510_latency_show, inode->i_private);
+}
+
+// Any write to the file resets the histograms, like RESET_LATENCY_HIST
+static ssize_t dm510_latency_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos) {
+    struct seq_file *m = filp->private_data;
+
+    dm510_hist_reset(m->private);
+    return count;
+}
+
+static const struct file_operations dm510_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = dm510_latency_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .write = dm510_latency_write,
+    .release = single_release,
 };
 
+static int dm510_stats_show(struct seq_file *m, void *v) {
+    struct dm510_device *dev = m->private;
+    struct dm510_stats *stats;
+    u64 sum, peak = 0;
+    int i, cpu;
+
+    for (i = 0; i < NR_DM510_STATS; i++) {
+        sum = 0;
+        for_each_possible_cpu(cpu)
+            sum += per_cpu_ptr(dev->stats, cpu)->count[i];
+        seq_printf(m, "%s %llu\n", dm510_stat_names[i], sum);
+    }
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(dev->stats, cpu);
+        peak = max(peak, stats->peak_used);
+    }
+    seq_printf(m, "peak_used %llu\n", peak);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dm510_stats);
+
+static void dm510_debugfs_init(void) {
+    char name[24];
+    int i;
+
+    // debugfs is best effort, the devices work without it
+    dm510_debugfs = debugfs_create_dir("dm510", NULL);
+    for (i = 0; i < DEVICE_COUNT; ++i) {
+        snprintf(name, sizeof(name), "dm510-%d", i);
+        debugfs_create_file(name, 0444, dm510_debugfs, &device[i], &dm510_stats_fops);
+        snprintf(name, sizeof(name), "dm510-%d-latency", i);
+        debugfs_create_file(name, 0644, dm510_debugfs, &device[i], &dm510_latency_fops);
+    }
+}
+
 static void dm510_setup_cdev(struct dm510_device *dev, int index) {
     int err;
     dev_t devno = MKDEV(dm510_major, MINOR_START + index);
@@ -307,37 +2893,119 @@ static void dm510_setup_cdev(struct dm510_device *dev, int index) {
         printk(KERN_NOTICE "Error %d adding DM510 device", err);
         return;
     }
+}
 
-    // Point the device's shared_buffer pointer to the actual shared_buffer
-    dev->shared_buffer = &shared_buffer;
+static int buffer_init(struct buffer *buf) {
+    // head and tail start out at 0
+    buf->ctrl = buffer_ctrl_alloc(BUFFER_SIZE);
+    buf->data = buffer_data_alloc(BUFFER_SIZE);
+    buf->size = BUFFER_SIZE;
+    if (!buf->ctrl || !buf->data)
+        return -ENOMEM;
+    if (percpu_init_rwsem(&buf->gate))
+        return -ENOMEM;
+    buf->shared_readers = false;
+    atomic_set(&buf->mapped, 0);
+    mutex_init(&buf->resize_lock);
+    mutex_init(&buf->producer);
+    mutex_init(&buf->consumer);
+    sema_init(&buf->sem, 1);
+    init_waitqueue_head(&buf->read_queue);
+    init_waitqueue_head(&buf->write_queue);
+    init_waitqueue_head(&buf->read_sleepers);
+    init_waitqueue_head(&buf->write_sleepers);
+    atomic64_set(&buf->read_wake_at, U64_MAX);
+    atomic64_set(&buf->write_wake_at, U64_MAX);
+    buf->broadcast = DM510_BROADCAST_OFF;
+    spin_lock_init(&buf->readers_lock);
+    INIT_LIST_HEAD(&buf->readers);
+    buf->direct = NULL;
+    spin_lock_init(&buf->direct_lock);
+    spin_lock_init(&buf->reserve_lock);
+    buf->claimed = 0;
+    INIT_LIST_HEAD(&buf->claims);
+    buf->overwrite = false;
+    atomic64_set(&buf->overwritten, 0);
+    buf->messages = false;
+    buf->subrings = NULL;
+    buf->ordered = false;
+    atomic64_set(&buf->seq, 0);
+    buf->next_seq = 1;
+    buf->next_cpu = 0;
+    buf->partial = NULL;
+    buf->elastic_limit = 0;
+    INIT_LIST_HEAD(&buf->segments);
+    INIT_LIST_HEAD(&buf->spares);
+    buf->nr_segments = buf->nr_spares = 0;
+    buf->stamps = NULL;
+    spin_lock_init(&buf->stamps_lock);
+    buf->first_stamp = buf->nr_stamps = 0;
+    return 0;
 }
 
-static void buffer_init(struct dm510_device *dev) {
+static void device_init(struct dm510_device *dev, int index) {
     // Initialize device-specific fields
-    sema_init(&shared_buffer.sem, 1);
+    sema_init(&dev->sem, 1);
     dev->nreaders = 0;
     dev->nwriters = 0;
     dev->max_processes = 1;
-    // Point to the shared buffer
-    dev->shared_buffer = &shared_buffer;
+    // Device i fills buffer i and drains the buffer filled by the other device
+    dev->write_buffer = &buffers[index];
+    dev->read_buffer = &buffers[(index + 1) % BUFFER_COUNT];
+}
+
+static void stats_free(void) {
+    int i;
+    for (i = 0; i < DEVICE_COUNT; ++i) {
+        free_percpu(device[i].stats);
+        device[i].stats = NULL;
+    }
+}
+
+static void buffers_free(void) {
+    int i;
+    for (i = 0; i < BUFFER_COUNT; ++i) {
+        elastic_release(&buffers[i]);
+        subrings_free(buffers[i].subrings);
+        buffers[i].subrings = NULL;
+        kfree(buffers[i].stamps);
+        buffers[i].stamps = NULL;
+        buffer_storage_free(buffers[i].ctrl, buffers[i].data);
+        buffers[i].ctrl = NULL;
+        buffers[i].data = NULL;
+        percpu_free_rwsem(&buffers[i].gate); // Safe on a buffer that never got this far
+    }
 }
 
 static int __init dm510_init(void) {
     int result, i;
     dev_t dev = 0;
-    //Initialize shared_buffer
-    shared_buffer.data = kzalloc(BUFFER_SIZE * sizeof(char), GFP_KERNEL);
-    if (!shared_buffer.data) {
-        // Handle memory allocation error
-        printk(KERN_WARNING "DM510: Unable to allocate shared buffer\n");
-        return -ENOMEM;
+    // Counters first, setting up the buffers already counts wake-ups on the devices
+    for (i = 0; i < DEVICE_COUNT; ++i) {
+        device[i].stats = alloc_percpu(struct dm510_stats);
+        if (!device[i].stats) {
+            stats_free();
+            return -ENOMEM;
+        }
+    }
+    //Initialize one buffer per direction
+    for (i = 0; i < BUFFER_COUNT; ++i) {
+        if (buffer_init(&buffers[i])) {
+            // Handle memory allocation error
+            printk(KERN_WARNING "DM510: Unable to allocate buffer %d\n", i);
+            buffers_free();
+            stats_free();
+            return -ENOMEM;
+        }
+        if (elastic_max && buffer_set_elastic(&buffers[i], elastic_max))
+            printk(KERN_WARNING "DM510: buffer %d stays a fixed ring, elastic_max %lu refused\n", i, elastic_max);
+    }
+    result = register_shrinker(&elastic_shrinker, "dm510-elastic");
+    if (result) {
+        buffers_free();
+        stats_free();
+        return result;
     }
-    shared_buffer.size = BUFFER_SIZE;
-    sema_init(&shared_buffer.sem, 1);
-    init_waitqueue_head(&shared_buffer.read_queue);
-    init_waitqueue_head(&shared_buffer.write_queue);
-    shared_buffer.head = 0;
-    shared_buffer.tail = 0;
 
     if (dm510_major) {
         dev = MKDEV(dm510_major, MINOR_START);
@@ -348,24 +3016,31 @@ static int __init dm510_init(void) {
     }
     if (result < 0) {
         printk(KERN_WARNING "DM510: can't get major %d\n", dm510_major);
+        unregister_shrinker(&elastic_shrinker);
+        buffers_free();
+        stats_free();
         return result;
     }
 
     for (i = 0; i < DEVICE_COUNT; ++i) {
-        buffer_init(&device[i]);
+        device_init(&device[i], i);
         dm510_setup_cdev(&device[i], i);
     }
+    dm510_debugfs_init();
     return 0;
 }
 
 static void __exit dm510_cleanup(void) {
     int i;
+    debugfs_remove_recursive(dm510_debugfs);
     for (i = 0; i < DEVICE_COUNT; ++i) {
         cdev_del(&device[i].cdev);
         
     }
     unregister_chrdev_region(MKDEV(dm510_major, MINOR_START), DEVICE_COUNT);
-    kfree(shared_buffer.data);
+    unregister_shrinker(&elastic_shrinker);
+    buffers_free();
+    stats_free();
 }
 
 module_init(dm510_init);
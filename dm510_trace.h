@@ -0,0 +1,174 @@
+/*
+ * Tracepoints of the dm510 data path, under events/dm510/ in tracefs, for ftrace,
+ * trace-cmd and perf. dm510_dev.c includes this after struct buffer and the
+ * ring_head()/ring_tail() helpers, which the events read only once they are enabled.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dm510
+
+#if !defined(_DM510_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DM510_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// open() let in or turned away: 0, -EBUSY or -EMFILE
+TRACE_EVENT(dm510_open,
+    TP_PROTO(int minor, unsigned int flags, int ret),
+    TP_ARGS(minor, flags, ret),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, flags)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->flags = flags;
+        __entry->ret = ret;
+    ),
+    TP_printk("dm510-%d flags=%#x ret=%d", __entry->minor, __entry->flags, __entry->ret)
+);
+
+// Last close of an open file, with the readers and writers still left on the device
+TRACE_EVENT(dm510_release,
+    TP_PROTO(int minor, unsigned int flags, int nreaders, int nwriters),
+    TP_ARGS(minor, flags, nreaders, nwriters),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, flags)
+        __field(int, nreaders)
+        __field(int, nwriters)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->flags = flags;
+        __entry->nreaders = nreaders;
+        __entry->nwriters = nwriters;
+    ),
+    TP_printk("dm510-%d flags=%#x readers=%d writers=%d", __entry->minor, __entry->flags,
+              __entry->nreaders, __entry->nwriters)
+);
+
+// A read or write arriving, with the bytes asked for and the ring's counters
+DECLARE_EVENT_CLASS(dm510_io_enter,
+    TP_PROTO(int minor, struct buffer *ring, size_t count),
+    TP_ARGS(minor, ring, count),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(size_t, count)
+        __field(u64, head)
+        __field(u64, tail)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->head = ring_head(ring);
+        __entry->tail = ring_tail(ring);
+    ),
+    TP_printk("dm510-%d count=%zu head=%llu tail=%llu", __entry->minor, __entry->count,
+              __entry->head, __entry->tail)
+);
+
+DEFINE_EVENT(dm510_io_enter, dm510_read_enter,
+    TP_PROTO(int minor, struct buffer *ring, size_t count),
+    TP_ARGS(minor, ring, count)
+);
+
+DEFINE_EVENT(dm510_io_enter, dm510_write_enter,
+    TP_PROTO(int minor, struct buffer *ring, size_t count),
+    TP_ARGS(minor, ring, count)
+);
+
+// A read or write done: bytes asked for, bytes moved or the error, and the counters after it
+DECLARE_EVENT_CLASS(dm510_io_exit,
+    TP_PROTO(int minor, struct buffer *ring, size_t count, ssize_t ret),
+    TP_ARGS(minor, ring, count, ret),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+        __field(u64, head)
+        __field(u64, tail)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->head = ring_head(ring);
+        __entry->tail = ring_tail(ring);
+    ),
+    TP_printk("dm510-%d count=%zu ret=%zd head=%llu tail=%llu", __entry->minor, __entry->count,
+              __entry->ret, __entry->head, __entry->tail)
+);
+
+DEFINE_EVENT(dm510_io_exit, dm510_read_exit,
+    TP_PROTO(int minor, struct buffer *ring, size_t count, ssize_t ret),
+    TP_ARGS(minor, ring, count, ret)
+);
+
+DEFINE_EVENT(dm510_io_exit, dm510_write_exit,
+    TP_PROTO(int minor, struct buffer *ring, size_t count, ssize_t ret),
+    TP_ARGS(minor, ring, count, ret)
+);
+
+// A reader or writer going to sleep until need bytes of data or space are there
+TRACE_EVENT(dm510_block,
+    TP_PROTO(int minor, bool reader, size_t need),
+    TP_ARGS(minor, reader, need),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(bool, reader)
+        __field(size_t, need)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->reader = reader;
+        __entry->need = need;
+    ),
+    TP_printk("dm510-%d %s need=%zu", __entry->minor, __entry->reader ? "read" : "write", __entry->need)
+);
+
+// The sleeper of dm510_block back up: 0 when its bytes are there, -ERESTARTSYS or -ETIME
+TRACE_EVENT(dm510_wakeup,
+    TP_PROTO(int minor, bool reader, int ret),
+    TP_ARGS(minor, reader, ret),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(bool, reader)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->reader = reader;
+        __entry->ret = ret;
+    ),
+    TP_printk("dm510-%d %s ret=%d", __entry->minor, __entry->reader ? "read" : "write", __entry->ret)
+);
+
+// A resize of the buffer a device writes into, through SET_BUFFER_SIZE or SET_BUFFER_SIZE64
+TRACE_EVENT(dm510_resize,
+    TP_PROTO(int minor, u64 old_size, u64 new_size, int ret),
+    TP_ARGS(minor, old_size, new_size, ret),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u64, old_size)
+        __field(u64, new_size)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->old_size = old_size;
+        __entry->new_size = new_size;
+        __entry->ret = ret;
+    ),
+    TP_printk("dm510-%d size=%llu new_size=%llu ret=%d", __entry->minor, __entry->old_size,
+              __entry->new_size, __entry->ret)
+);
+
+#endif /* _DM510_TRACE_H */
+
+// The header sits next to dm510_dev.c rather than in include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dm510_trace
+#include <trace/define_trace.h>
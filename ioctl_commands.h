@@ -1,16 +1,141 @@
-#ifndef IOCTL_COMMANDS
-#define IOCTL_COMMANDS
-
-//Defined command codes for ioctl operations
-#define GET_BUFFER_SIZE 0   //Command to get current size of the buffer in bytes
-#define SET_BUFFER_SIZE 1  //Command to set a new size for the buffer in bytes
-#define GET_MAX_NR_PROCESSES 2  //Command to get maximum number of processes allowed to acess the device
-#define SET_MAX_NR_PROCESSES 3  //Command to set maximum number of processes allowed to acess the device
-#define GET_BUFFER_FREE_SPACE 4  //Command to query the amount of free space in the device buffer
-#define GET_BUFFER_USED_SPACE 5  //Command to query the aomunt of used space in the device buffer
-
-//Defined constants for our device managment 
-#define DEVICE_COUNT 2  //The number of devices manged by the driver
-#define BUFFER_COUNT 2  //The Number of buffers associated with each device
-
-#endif /* end of include guard: IOCTL_COMMANDS */
+#ifndef IOCTL_COMMANDS
+#define IOCTL_COMMANDS
+
+//Defined command codes for ioctl operations
+//Each device writes into its own buffer and reads from the buffer the other device writes into.
+//The size and free space commands refer to the buffer the device writes into, the used space
+//command to the buffer it reads from.
+#define GET_BUFFER_SIZE 0   //Command to get current size of the buffer in bytes
+#define SET_BUFFER_SIZE 1  //Command to set a new size for the buffer in bytes, rounded up to a power of two and written back
+#define GET_MAX_NR_PROCESSES 2  //Command to get maximum number of processes allowed to acess the device
+#define SET_MAX_NR_PROCESSES 3  //Command to set maximum number of processes allowed to acess the device
+#define GET_BUFFER_FREE_SPACE 4  //Command to query the amount of free space in the device buffer
+#define GET_BUFFER_USED_SPACE 5  //Command to query the aomunt of used space in the device buffer
+#define NOTIFY_DATA_WRITTEN 6  //Command to wake readers after advancing tail in a mapped buffer
+#define NOTIFY_DATA_READ 7  //Command to wake the writer after advancing head in a mapped buffer
+#define WAIT_FOR_DATA 8  //Command to sleep until the read buffer has data, returns the used space
+#define WAIT_FOR_SPACE 9  //Command to sleep until the write buffer has room, returns the free space
+#define GET_BUFFER_SIZE64 10  //Like GET_BUFFER_SIZE, with an unsigned long long argument
+#define SET_BUFFER_SIZE64 11  //Like SET_BUFFER_SIZE, with an unsigned long long argument for sizes above 1 GB
+#define SET_BUFFER_ELASTIC 12  //Command to switch the write buffer to pages allocated on demand up to an unsigned long long
+                               //ceiling in bytes, or back to a fixed ring with 0. Switching needs an empty, unmapped buffer;
+                               //the ceiling of an elastic buffer can change any time. GET_BUFFER_SIZE reports the ceiling,
+                               //SET_BUFFER_SIZE fails with EBUSY and elastic buffers can't be mapped.
+#define SET_READ_LOWAT 13  //Command to make blocking reads on this open file wait for this many bytes (int, 0 for any)
+                           //and poll report readable only then; reads still return early once the writer closes
+#define SET_WRITE_LOWAT 14  //Command to make blocking writes on this open file wait for this much free space (int, 0 for any)
+#define SET_COALESCE_DELAY 15  //Command to bound in microseconds how long a read holds out for its watermark (int, 0 for no bound)
+#define SET_MESSAGE_MODE 16  //Command to make the write buffer hold messages (int, 1) or a byte stream (int, 0); it has to be empty.
+                             //Each write is then one message, stored whole or not at all (EMSGSIZE if it can never fit),
+                             //and each read returns one whole message (EMSGSIZE if it doesn't fit, the message stays)
+#define SET_MESSAGE_BATCH 17  //Command to make reads on this open file return as many whole messages as fit (int, 1), each
+                              //behind a DM510_MSG_HEADER, instead of one bare message (int, 0)
+#define GET_NEXT_MESSAGE_SIZE 18  //Command to get the payload length of the next message in the read buffer (ENOMSG if none)
+#define SET_BROADCAST_MODE 19  //Command to make every reader of the write buffer get every byte, each from its own cursor
+                               //(int, one of DM510_BROADCAST_*). Space comes back once the slowest reader is past it.
+                               //Broadcast buffers can't be mapped, and SKIP doesn't go with message mode (EINVAL).
+#define GET_LOST_BYTES 20  //Command to get and clear how many bytes of the read buffer this open file missed (unsigned long long),
+                           //including what an overwriting writer dropped since the last reader asked
+#define SET_MULTI_WRITER 21  //Command to let any number of writers onto the device (int, one of DM510_WRITERS_*). Each CPU gets
+                             //a ring of the buffer's size and every write goes in whole as one record. Reads return the records
+                             //back to back, a record that doesn't fit read in parts by the reads that follow before any other
+                             //record, or, in message mode, whole like messages. Needs an empty fixed ring, and going back to
+                             //one writer needs the rings drained and the other writers gone (EBUSY).
+#define SET_OVERWRITE_MODE 22  //Command to make writes to the write buffer drop its oldest bytes instead of waiting when it is
+                               //full (int, 1), or wait again (int, 0). Whole messages are dropped in message mode, and
+                               //writes larger than the buffer write what fits. Not for mapped, elastic, broadcast or
+                               //multi-writer buffers.
+#define SET_FULL_TRANSFER 23  //Command to make blocking reads and/or writes on this open file transfer the whole request before
+                              //returning (int, DM510_FULL_* bits, 0 for neither). A signal returns what was transferred so far,
+                              //and a full read returns early once the writer is gone and the buffer drained.
+#define SUBMIT_BATCH 24  //Command to run a vector of operations on open dm510 files in one call (struct dm510_batch). Each
+                         //operation's result goes into its entry; returns how many ran, a signal stops the batch early
+#define GET_LATENCY_HIST 25  //Command to get the device's latency histograms (struct dm510_latency_hist)
+#define RESET_LATENCY_HIST 26  //Command to zero the device's latency histograms
+#define SET_RESIDENCY_TRACKING 27  //Command to timestamp each write into the write buffer (int, 1) or stop (int, 0). The reading
+                                   //device's DM510_HIST_RESIDENCY histogram then gets how long each write waited until its
+                                   //last byte was read. Not for multi-writer buffers.
+#define GET_OLDEST_AGE 28  //Command to get how many nanoseconds the oldest unread byte of the read buffer has waited
+                           //(unsigned long long), 0 if it is empty or not tracked
+//The int commands fail GET_BUFFER_SIZE with EOVERFLOW and report at most INT_MAX bytes of space
+//once a buffer is larger than an int can hold.
+
+//mmap() offsets selecting which buffer of the device to map. A mapping is the control page
+//below followed by the data pages, and has to be MAP_SHARED. The driver keeps the control page
+//apart from the data pages, so only the data pages can be huge pages; the mapping still puts
+//the data one page in, right behind the control page. Mapping the read buffer writable (so the
+//consumer can advance head) needs the device opened O_RDWR.
+#define DM510_MMAP_WRITE_BUFFER 0x00000000  //The buffer the device writes into
+#define DM510_MMAP_READ_BUFFER 0x10000000  //The buffer the device reads from
+
+//Layout of the control page, head and tail sit on their own cache lines. They count bytes
+//and never wrap: tail - head is the used space and a counter's offset in the data area is
+//counter & (size - 1).
+#define DM510_CACHE_LINE 64
+struct dm510_ring_ctrl {
+    unsigned long long head __attribute__((aligned(DM510_CACHE_LINE)));  //Bytes read so far, advanced by the consumer
+    unsigned long long tail __attribute__((aligned(DM510_CACHE_LINE)));  //Bytes written so far, advanced by the producer
+    unsigned long long size __attribute__((aligned(DM510_CACHE_LINE)));  //Size of the data area in bytes, a power of two, read only
+};
+
+//In message mode each message sits in the buffer behind a header holding its payload length as a
+//native unsigned int. Batch reads hand the messages out in the same layout.
+#define DM510_MSG_HEADER 4
+
+//Broadcast modes for SET_BROADCAST_MODE
+#define DM510_BROADCAST_OFF 0  //Readers share one head, each byte goes to one of them
+#define DM510_BROADCAST_BLOCK 1  //The writer waits for the slowest reader
+#define DM510_BROADCAST_SKIP 2  //The writer moves readers that lag a full buffer behind ahead, they lose those bytes
+
+//Writer modes for SET_MULTI_WRITER
+#define DM510_WRITERS_SINGLE 0  //One writer, one ring
+#define DM510_WRITERS_PERCPU 1  //Per-CPU rings, reads take turns between them
+#define DM510_WRITERS_ORDERED 2  //Per-CPU rings, reads follow the order the writes were made in
+
+//Bits for SET_FULL_TRANSFER
+#define DM510_FULL_READ 1
+#define DM510_FULL_WRITE 2
+
+//Operations for SUBMIT_BATCH
+#define DM510_OP_READ 0  //read() len bytes into buf
+#define DM510_OP_WRITE 1  //write() len bytes from buf
+#define DM510_OP_USED 2  //Like GET_BUFFER_USED_SPACE, without the int limit
+#define DM510_OP_FREE 3  //Like GET_BUFFER_FREE_SPACE, without the int limit
+#define DM510_BATCH_MAX 256  //Most operations in one batch
+
+struct dm510_op {
+    int fd;  //Open dm510 file the operation goes to, any of the devices
+    int opcode;  //DM510_OP_*
+    unsigned long long buf;  //User buffer of a read or write
+    unsigned long long len;  //Its length in bytes
+    long long result;  //Set by the driver: bytes transferred, space for a query, or a negative errno
+};
+
+struct dm510_batch {
+    unsigned long long ops;  //Array of count struct dm510_op
+    unsigned int count;
+    unsigned int pad;
+};
+
+//Phases timed by the latency histograms, in nanoseconds. WAIT is time asleep for data or space,
+//LOCK time waiting for a buffer's locks held by someone else, COPY time moving the bytes.
+//RESIDENCY is the time writes spent in the read buffer, see SET_RESIDENCY_TRACKING.
+#define DM510_HIST_READ_WAIT 0
+#define DM510_HIST_READ_LOCK 1
+#define DM510_HIST_READ_COPY 2
+#define DM510_HIST_WRITE_WAIT 3
+#define DM510_HIST_WRITE_LOCK 4
+#define DM510_HIST_WRITE_COPY 5
+#define DM510_HIST_RESIDENCY 6
+#define DM510_HIST_PHASES 7
+#define DM510_HIST_BUCKETS 40  //Bucket i counts samples of [2^i, 2^(i+1)) ns, 0 includes 0 and the last everything above
+
+struct dm510_latency_hist {
+    unsigned long long bucket[DM510_HIST_PHASES][DM510_HIST_BUCKETS];
+};
+
+//Defined constants for our device managment 
+#define DEVICE_COUNT 2  //The number of devices manged by the driver
+#define BUFFER_COUNT 2  //The Number of buffers associated with each device
+
+#endif /* end of include guard: IOCTL_COMMANDS */
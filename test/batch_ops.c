@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "ioctl_commands.h"
+
+int main() {
+    int writer = open("/dev/dm510-0", O_WRONLY | O_NONBLOCK);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Write on one device, check and drain the other, all in one ioctl
+    const char *message = "batched hello";
+    char buf[64] = { 0 };
+    struct dm510_op ops[] = {
+        { .fd = writer, .opcode = DM510_OP_WRITE, .buf = (unsigned long)message, .len = strlen(message) },
+        { .fd = reader, .opcode = DM510_OP_USED },
+        { .fd = reader, .opcode = DM510_OP_READ, .buf = (unsigned long)buf, .len = sizeof(buf) - 1 },
+        { .fd = writer, .opcode = DM510_OP_FREE },
+        { .fd = reader, .opcode = DM510_OP_WRITE, .buf = (unsigned long)message, .len = 1 },
+    };
+    const char *names[] = { "write", "used", "read", "free", "write to reader" };
+    struct dm510_batch batch = { .ops = (unsigned long)ops, .count = sizeof(ops) / sizeof(ops[0]) };
+
+    int ran = ioctl(writer, SUBMIT_BATCH, &batch);
+    if (ran < 0) {
+        fprintf(stderr, "Failed to submit the batch: %s\n", strerror(errno));
+        close(writer);
+        close(reader);
+        return 2;
+    }
+    printf("%d operations ran\n", ran);
+    for (int i = 0; i < ran; i++) {
+        if (ops[i].result < 0) {
+            printf("  %s: %s\n", names[i], strerror(-ops[i].result));
+        } else {
+            printf("  %s: %lld\n", names[i], ops[i].result);
+        }
+    }
+    printf("Read back '%s'\n", buf);
+
+    close(writer);
+    close(reader);
+    return 0;
+}
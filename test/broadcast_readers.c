@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "ioctl_commands.h"
+
+//Interrupts a write that would wait forever on readers that never get their bytes
+void on_alarm(int sig) {
+    (void)sig;
+}
+
+int main() {
+    int writer = open("/dev/dm510-0", O_WRONLY | O_NONBLOCK);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    //Two readers on the same buffer, each with its own cursor
+    int first = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+    if (first < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+    int max_readers = 2;
+    ioctl(first, SET_MAX_NR_PROCESSES, &max_readers);
+    int second = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+    if (second < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        close(first);
+        return 1;
+    }
+
+    int mode = DM510_BROADCAST_BLOCK;
+    if (ioctl(writer, SET_BROADCAST_MODE, &mode) < 0) {
+        fprintf(stderr, "Failed to switch to broadcast mode: %s\n", strerror(errno));
+        close(writer);
+        close(first);
+        close(second);
+        return 2;
+    }
+
+    //Both readers should get the whole message
+    const char *message = "hello, everyone";
+    write(writer, message, strlen(message));
+    char buf[64];
+    ssize_t n = read(first, buf, sizeof(buf));
+    printf("First reader: %zd bytes '%.*s'\n", n, (int)(n > 0 ? n : 0), buf);
+    n = read(second, buf, sizeof(buf));
+    printf("Second reader: %zd bytes '%.*s'\n", n, (int)(n > 0 ? n : 0), buf);
+
+    //With SKIP the writer never waits: the second reader falls behind and loses bytes
+    mode = DM510_BROADCAST_SKIP;
+    ioctl(writer, SET_BROADCAST_MODE, &mode);
+    int size;
+    ioctl(writer, GET_BUFFER_SIZE, &size);
+    static char block[4096];
+    memset(block, 'x', sizeof(block));
+    ssize_t written = 0;
+    for (int i = 0; i < 3; i++) {
+        //Keep the first reader up to date
+        ssize_t w = write(writer, block, size < (int)sizeof(block) ? size : (int)sizeof(block));
+        if (w > 0) {
+            written += w;
+        }
+        while (read(first, block, sizeof(block)) > 0) {
+        }
+        memset(block, 'x', sizeof(block));
+    }
+    unsigned long long lost = 0;
+    ioctl(second, GET_LOST_BYTES, &lost);
+    printf("Wrote %zd bytes, the second reader lost %llu of them\n", written, lost);
+
+    //Two blocking readers at once, several buffers' worth: a reader that caught up sleeps
+    //while the other one still has bytes to read, and the writer waits for the one behind
+    while (read(first, block, sizeof(block)) > 0) {
+    }
+    while (read(second, block, sizeof(block)) > 0) {
+    }
+    mode = DM510_BROADCAST_BLOCK;
+    ioctl(writer, SET_BROADCAST_MODE, &mode);
+    fcntl(writer, F_SETFL, 0);
+    fcntl(first, F_SETFL, 0);
+    fcntl(second, F_SETFL, 0);
+    long long total = 4LL * size;
+    int readers[2] = { first, second };
+    pid_t pids[2];
+    for (int i = 0; i < 2; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            alarm(10);
+            long long got = 0;
+            while (got < total) {
+                ssize_t r = read(readers[i], block, sizeof(block));
+                if (r <= 0) {
+                    exit(1);
+                }
+                got += r;
+            }
+            exit(0);
+        }
+    }
+    struct sigaction sa = { .sa_handler = on_alarm };
+    sigaction(SIGALRM, &sa, NULL);
+    alarm(10);
+    long long sent = 0;
+    while (sent < total) {
+        ssize_t w = write(writer, block, total - sent < (long long)sizeof(block) ? total - sent : (long long)sizeof(block));
+        if (w < 0) {
+            break;
+        }
+        sent += w;
+    }
+    alarm(0);
+    int done = 0;
+    for (int i = 0; i < 2; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        done += WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    printf("Blocking readers: wrote %lld of %lld bytes, %d of 2 readers got all of them\n", sent, total, done);
+
+    mode = DM510_BROADCAST_OFF;
+    ioctl(writer, SET_BROADCAST_MODE, &mode);
+    close(writer);
+    close(first);
+    close(second);
+    return done == 2 ? 0 : 3;
+}
@@ -34,11 +34,17 @@ int main(int argc, char const *argv[]) {
         // Use errno to determine the type of error
         switch(errno) {
             case EINVAL:
-                printf("Cannot reduce buffer size to %d bytes; requested size is below the minimum allowed.\n", newSize);
+                printf("Cannot change buffer size to %d bytes; requested size is below the minimum or above the maximum allowed.\n", newSize);
                 break;
             case ENOMEM:
                 printf("Failed to allocate memory for the new buffer size.\n");
                 break;
+            case ENOSPC:
+                printf("Cannot shrink buffer to %d bytes; more data than that is waiting to be read.\n", newSize);
+                break;
+            case EBUSY:
+                printf("Cannot resize the buffer while it is mapped, elastic or split into per-CPU rings.\n");
+                break;
             default:
                 printf("Buffer size change failed for an unknown reason. Error code: %d\n", errno);
                 break;
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "ioctl_commands.h"
+
+//Far more than the fixed 1 KB ring holds
+#define BURST (64 * 1024)
+#define CEILING (1024 * 1024)
+
+int main() {
+    int writer = open("/dev/dm510-0", O_WRONLY | O_NONBLOCK);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Let the buffer grow page by page up to the ceiling
+    unsigned long long ceiling = CEILING;
+    if (ioctl(writer, SET_BUFFER_ELASTIC, &ceiling) < 0) {
+        fprintf(stderr, "Failed to make the buffer elastic: %s\n", strerror(errno));
+        close(writer);
+        close(reader);
+        return 2;
+    }
+
+    //The whole burst goes in with one non-blocking write
+    static char out[BURST], in[BURST];
+    for (int i = 0; i < BURST; i++) {
+        out[i] = i % 251;
+    }
+    ssize_t written = write(writer, out, sizeof(out));
+    if (written < 0) {
+        perror("Failed to write to device");
+    } else {
+        printf("Wrote %zd of %d bytes without blocking\n", written, BURST);
+    }
+
+    //Drain it again, the pages go back as the reader moves past them
+    ssize_t bytes_read = read(reader, in, sizeof(in));
+    if (bytes_read < 0) {
+        perror("Failed to read from device");
+    } else {
+        printf("Read %zd bytes, %s\n", bytes_read,
+               bytes_read == written && memcmp(in, out, bytes_read) == 0 ? "contents match" : "contents differ");
+    }
+
+    //Back to a fixed ring now that the buffer is empty
+    ceiling = 0;
+    if (ioctl(writer, SET_BUFFER_ELASTIC, &ceiling) < 0) {
+        fprintf(stderr, "Failed to switch back to a fixed ring: %s\n", strerror(errno));
+    }
+
+    close(writer);
+    close(reader);
+    return 0;
+}
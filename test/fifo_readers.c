@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "ioctl_commands.h"
+
+//Number of blocked readers, each waits for one 4 byte record
+#define READERS 4
+
+int main() {
+    //Let enough readers onto dm510-1
+    int control = open("/dev/dm510-1", O_RDONLY);
+    if (control < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        return 1;
+    }
+    int max_readers = READERS + 1;
+    if (ioctl(control, SET_MAX_NR_PROCESSES, &max_readers) < 0) {
+        perror("Failed to set the maximum number of reader processes");
+        close(control);
+        return 1;
+    }
+
+    //Start the readers one after the other, so they queue up in a known order
+    for (int i = 0; i < READERS; i++) {
+        if (fork() == 0) {
+            int fd = open("/dev/dm510-1", O_RDONLY);
+            if (fd < 0) {
+                perror("Reader failed to open /dev/dm510-1");
+                exit(1);
+            }
+            int lowat = 4;
+            ioctl(fd, SET_READ_LOWAT, &lowat);
+            char record[5] = { 0 };
+            ssize_t n = read(fd, record, 4);
+            printf("Reader %d got %zd bytes: '%s'\n", i, n, record);
+            close(fd);
+            exit(0);
+        }
+        usleep(100000);
+    }
+
+    //Each record should wake exactly one reader, the one that has waited longest
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        close(control);
+        return 1;
+    }
+    char record[5];
+    for (int i = 0; i < READERS; i++) {
+        snprintf(record, sizeof(record), "rec%d", i);
+        write(writer, record, 4);
+        usleep(100000);
+    }
+
+    for (int i = 0; i < READERS; i++) {
+        wait(NULL);
+    }
+    close(writer);
+    close(control);
+    return 0;
+}
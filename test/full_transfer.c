@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "ioctl_commands.h"
+
+//Many times the 1 KB ring, moved with one write() and one read()
+#define TOTAL (256 * 1024)
+
+int main() {
+    static char out[TOTAL], in[TOTAL];
+    for (int i = 0; i < TOTAL; i++) {
+        out[i] = i % 253;
+    }
+
+    if (fork() == 0) {
+        int writer = open("/dev/dm510-0", O_WRONLY);
+        if (writer < 0) {
+            perror("Failed to open /dev/dm510-0");
+            exit(1);
+        }
+        int mode = DM510_FULL_WRITE;
+        if (ioctl(writer, SET_FULL_TRANSFER, &mode) < 0) {
+            perror("Failed to switch to full writes");
+            exit(2);
+        }
+        ssize_t written = write(writer, out, TOTAL);
+        printf("One write() stored %zd of %d bytes\n", written, TOTAL);
+        close(writer);
+        exit(0);
+    }
+
+    int reader = open("/dev/dm510-1", O_RDONLY);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        return 1;
+    }
+    int mode = DM510_FULL_READ;
+    if (ioctl(reader, SET_FULL_TRANSFER, &mode) < 0) {
+        fprintf(stderr, "Failed to switch to full reads: %s\n", strerror(errno));
+        close(reader);
+        return 2;
+    }
+    ssize_t bytes_read = read(reader, in, TOTAL);
+    printf("One read() got %zd of %d bytes, %s\n", bytes_read, TOTAL,
+           bytes_read == TOTAL && memcmp(in, out, TOTAL) == 0 ? "contents match" : "contents differ");
+
+    wait(NULL);
+    close(reader);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "ioctl_commands.h"
+
+//Rounds of writes and reads to fill the histograms with
+#define ROUNDS 1000
+
+static const char *phases[DM510_HIST_PHASES] = {
+    "read wait", "read lock", "read copy", "write wait", "write lock", "write copy", "residency",
+};
+
+//Upper bound in nanoseconds of the bucket holding the given fraction of the samples
+unsigned long long percentile(const unsigned long long *bucket, unsigned long long total, double fraction) {
+    unsigned long long seen = 0;
+    int i;
+    for (i = 0; i < DM510_HIST_BUCKETS - 1; i++) {
+        seen += bucket[i];
+        if (seen >= total * fraction)
+            break;
+    }
+    return 2ULL << i;
+}
+
+int main() {
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Start from empty histograms on both devices
+    if (ioctl(writer, RESET_LATENCY_HIST) < 0 || ioctl(reader, RESET_LATENCY_HIST) < 0) {
+        fprintf(stderr, "Failed to reset the latency histograms: %s\n", strerror(errno));
+        close(writer);
+        close(reader);
+        return 2;
+    }
+
+    char buf[256];
+    memset(buf, 'x', sizeof(buf));
+    for (int i = 0; i < ROUNDS; i++) {
+        write(writer, buf, sizeof(buf));
+        read(reader, buf, sizeof(buf));
+    }
+
+    //Writes are timed on dm510-0, reads on dm510-1
+    struct dm510_latency_hist hist[2];
+    if (ioctl(writer, GET_LATENCY_HIST, &hist[0]) < 0 || ioctl(reader, GET_LATENCY_HIST, &hist[1]) < 0) {
+        fprintf(stderr, "Failed to get the latency histograms: %s\n", strerror(errno));
+        close(writer);
+        close(reader);
+        return 2;
+    }
+    for (int dev = 0; dev < 2; dev++) {
+        for (int phase = 0; phase < DM510_HIST_PHASES; phase++) {
+            unsigned long long total = 0;
+            for (int i = 0; i < DM510_HIST_BUCKETS; i++)
+                total += hist[dev].bucket[phase][i];
+            if (!total)
+                continue;
+            printf("dm510-%d %-10s %6llu samples, p50 < %llu ns, p99 < %llu ns, p999 < %llu ns\n", dev, phases[phase],
+                   total, percentile(hist[dev].bucket[phase], total, 0.5),
+                   percentile(hist[dev].bucket[phase], total, 0.99),
+                   percentile(hist[dev].bucket[phase], total, 0.999));
+        }
+    }
+
+    close(writer);
+    close(reader);
+    return 0;
+}
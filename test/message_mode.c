@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "ioctl_commands.h"
+
+int main() {
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Every write from now on is one message
+    int on = 1;
+    if (ioctl(writer, SET_MESSAGE_MODE, &on) < 0) {
+        fprintf(stderr, "Failed to switch to message mode: %s\n", strerror(errno));
+        close(writer);
+        close(reader);
+        return 2;
+    }
+    const char *messages[] = { "one", "two!", "three" };
+    for (int i = 0; i < 3; i++) {
+        write(writer, messages[i], strlen(messages[i]));
+    }
+
+    //A plain read returns exactly one message, however large the buffer
+    char buf[64];
+    ssize_t n = read(reader, buf, sizeof(buf));
+    printf("Single read: %zd bytes '%.*s'\n", n, (int)(n > 0 ? n : 0), buf);
+
+    int next;
+    if (ioctl(reader, GET_NEXT_MESSAGE_SIZE, &next) == 0) {
+        printf("Next message is %d bytes\n", next);
+    }
+    //Too small for the next message: EMSGSIZE and the message stays
+    n = read(reader, buf, 2);
+    printf("Read into 2 bytes: %zd (%s)\n", n, n < 0 ? strerror(errno) : "ok");
+
+    //A batch read packs the rest, each message behind its length
+    ioctl(reader, SET_MESSAGE_BATCH, &on);
+    n = read(reader, buf, sizeof(buf));
+    printf("Batch read: %zd bytes\n", n);
+    for (ssize_t off = 0; off + DM510_MSG_HEADER <= n;) {
+        unsigned int len;
+        memcpy(&len, buf + off, sizeof(len));
+        off += DM510_MSG_HEADER;
+        printf("  message '%.*s'\n", (int)len, buf + off);
+        off += len;
+    }
+
+    //Back to a byte stream, the buffer is empty again
+    int off = 0;
+    ioctl(writer, SET_MESSAGE_MODE, &off);
+
+    close(writer);
+    close(reader);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "ioctl_commands.h"
+
+int main(int argc, char const *argv[]) {
+    //Check if a message was provided as an argument
+    if (argc <= 1) {
+        fprintf(stderr, "Usage: %s <message>\n", argv[0]);
+        return 1;
+    }
+    //Open the producer side, its write buffer is mapped below
+    int writer = open("/dev/dm510-0", O_RDWR);
+    if (writer < 0) {
+        perror("Error opening /dev/dm510-0");
+        return 1;
+    }
+    //Open the consumer side, it reads with a plain read()
+    int reader = open("/dev/dm510-1", O_RDWR);
+    if (reader < 0) {
+        perror("Error opening /dev/dm510-1");
+        close(writer);
+        return 1;
+    }
+
+    //The mapping is the control page followed by the data pages
+    int buffer_size;
+    if (ioctl(writer, GET_BUFFER_SIZE, &buffer_size) < 0) {
+        perror("Failed to get buffer size");
+        close(writer);
+        close(reader);
+        return 1;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t length = page_size + ((buffer_size + page_size - 1) / page_size) * page_size;
+    char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, writer, DM510_MMAP_WRITE_BUFFER);
+    if (map == MAP_FAILED) {
+        perror("Failed to map the write buffer");
+        close(writer);
+        close(reader);
+        return 1;
+    }
+    struct dm510_ring_ctrl *ctrl = (struct dm510_ring_ctrl *)map;
+    char *data = map + page_size;
+
+    //Produce the message in place, it may wrap around the end of the data area
+    const char *msg = argv[1];
+    size_t size = strlen(msg);
+    unsigned long long tail = ctrl->tail;
+    unsigned long long head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+    size_t space = ctrl->size - (tail - head);
+    if (size > space) {
+        printf("Buffer only has room for %zu bytes\n", space);
+        size = space;
+    }
+    for (size_t i = 0; i < size; i++) {
+        data[(tail + i) & (ctrl->size - 1)] = msg[i];
+    }
+    //Publish the bytes and wake up the reader of the other device
+    __atomic_store_n(&ctrl->tail, tail + size, __ATOMIC_RELEASE);
+    ioctl(writer, NOTIFY_DATA_WRITTEN);
+    printf("Written message: '%.*s'\n", (int)size, msg);
+
+    //Read it back through the other device
+    char *buf = malloc(size + 1);
+    if (buf == NULL) {
+        perror("Failed to allocate buffer");
+        munmap(map, length);
+        close(writer);
+        close(reader);
+        return 1;
+    }
+    ssize_t bytesRead = read(reader, buf, size);
+    if (bytesRead < 0) {
+        perror("Error reading from device");
+    } else {
+        buf[bytesRead] = '\0';
+        printf("Message read : '%s'\n", buf);
+    }
+
+    //clean up
+    free(buf);
+    munmap(map, length);
+    close(writer);
+    close(reader);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "ioctl_commands.h"
+
+//Writer processes and the records each of them writes
+#define WRITERS 4
+#define RECORDS 100
+#define PIECE 7  //Bytes per read, less than any record
+
+int main() {
+    int reader = open("/dev/dm510-1", O_RDONLY);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        return 1;
+    }
+    //dm510-0 takes any number of writers from now on, and reads follow the write order
+    int control = open("/dev/dm510-0", O_WRONLY);
+    if (control < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        close(reader);
+        return 1;
+    }
+    int mode = DM510_WRITERS_ORDERED;
+    if (ioctl(control, SET_MULTI_WRITER, &mode) < 0) {
+        fprintf(stderr, "Failed to switch to multi-writer mode: %s\n", strerror(errno));
+        close(control);
+        close(reader);
+        return 2;
+    }
+
+    for (int i = 0; i < WRITERS; i++) {
+        if (fork() == 0) {
+            int fd = open("/dev/dm510-0", O_WRONLY);
+            if (fd < 0) {
+                perror("Writer failed to open /dev/dm510-0");
+                exit(1);
+            }
+            char record[32];
+            for (int j = 0; j < RECORDS; j++) {
+                int len = snprintf(record, sizeof(record), "writer %d record %d\n", i, j);
+                write(fd, record, len);
+            }
+            close(fd);
+            exit(0);
+        }
+    }
+
+    //Reads smaller than a record get it in parts, but the lines never get mixed up and each
+    //writer's records come out in the order it wrote them
+    char buf[PIECE], line[64];
+    int lines = 0, used = 0, mixed = 0, next[WRITERS] = { 0 };
+    while (lines < WRITERS * RECORDS) {
+        ssize_t n = read(reader, buf, sizeof(buf));
+        if (n <= 0) {
+            perror("Failed to read from device");
+            break;
+        }
+        for (ssize_t k = 0; k < n; k++) {
+            if (used < (int)sizeof(line) - 1)
+                line[used++] = buf[k];
+            if (buf[k] != '\n')
+                continue;
+            line[used] = '\0';
+            int i, j;
+            if (sscanf(line, "writer %d record %d\n", &i, &j) != 2 || i < 0 || i >= WRITERS || j != next[i]++)
+                mixed++;
+            used = 0;
+            lines++;
+        }
+    }
+    printf("Read %d of %d records, %d mixed up or out of order\n", lines, WRITERS * RECORDS, mixed);
+
+    for (int i = 0; i < WRITERS; i++) {
+        wait(NULL);
+    }
+    mode = DM510_WRITERS_SINGLE;
+    ioctl(control, SET_MULTI_WRITER, &mode);
+    close(control);
+    close(reader);
+    return mixed ? 3 : 0;
+}
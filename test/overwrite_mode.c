@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "ioctl_commands.h"
+
+int main() {
+    //Blocking writer: in overwrite mode it never has to wait for the reader
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    int on = 1;
+    if (ioctl(writer, SET_OVERWRITE_MODE, &on) < 0) {
+        fprintf(stderr, "Failed to switch to overwrite mode: %s\n", strerror(errno));
+        close(writer);
+        close(reader);
+        return 2;
+    }
+
+    //Write three times what the buffer holds, one numbered line after the other
+    int size;
+    ioctl(writer, GET_BUFFER_SIZE, &size);
+    char line[16];
+    int written = 0, lines = 0;
+    while (written < 3 * size) {
+        int len = snprintf(line, sizeof(line), "%07d\n", lines++);
+        written += write(writer, line, len);
+    }
+    printf("Wrote %d bytes into a %d byte buffer\n", written, size);
+
+    //Only the newest bytes are left, the rest is reported as lost
+    static char buf[1 << 16];
+    ssize_t n = read(reader, buf, sizeof(buf));
+    unsigned long long lost = 0;
+    ioctl(reader, GET_LOST_BYTES, &lost);
+    printf("Read %zd bytes, %llu bytes were overwritten\n", n, lost);
+    if (n > 8) {
+        printf("Last line: %.7s\n", buf + n - 8);
+    }
+
+    int off = 0;
+    ioctl(writer, SET_OVERWRITE_MODE, &off);
+    close(writer);
+    close(reader);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+//Number of milliseconds to wait for an event
+#define TIMEOUT 1000
+
+//Wait for one round of events and print what each device reported
+int wait_and_print(int epoll_fd, const char *when) {
+    struct epoll_event events[2];
+    int n = epoll_wait(epoll_fd, events, 2, TIMEOUT);
+    if (n < 0) {
+        perror("epoll_wait");
+        return -1;
+    }
+    printf("%s: %d event(s)\n", when, n);
+    for (int i = 0; i < n; i++) {
+        printf("  dm510-%d:%s%s\n", events[i].data.u32,
+               (events[i].events & EPOLLIN) ? " readable" : "",
+               (events[i].events & EPOLLOUT) ? " writable" : "");
+    }
+    return n;
+}
+
+int main() {
+    //The writer only cares about space, the reader only about data
+    int writer = open("/dev/dm510-0", O_WRONLY | O_NONBLOCK);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Register both devices edge-triggered with one epoll instance
+    int epoll_fd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.u32 = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, writer, &ev);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u32 = 1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reader, &ev);
+
+    //Expect dm510-0 writable, dm510-1 not readable yet
+    wait_and_print(epoll_fd, "Empty buffer");
+    //Edge-triggered: nothing changed, so nothing should be reported
+    wait_and_print(epoll_fd, "No change");
+
+    //Writing makes the reader side readable
+    const char msg[] = "poll";
+    if (write(writer, msg, sizeof(msg)) < 0) {
+        perror("Failed to write to device");
+    }
+    wait_and_print(epoll_fd, "After write");
+
+    //Draining the data gives the writer a fresh writable edge
+    char buf[sizeof(msg)];
+    if (read(reader, buf, sizeof(buf)) < 0) {
+        perror("Failed to read from device");
+    }
+    wait_and_print(epoll_fd, "After read");
+
+    //Armed while the buffer had room: filling it and reading a little must still give an edge
+    char fill[256];
+    memset(fill, 'f', sizeof(fill));
+    ssize_t filled = 0, n;
+    while ((n = write(writer, fill, sizeof(fill))) > 0)
+        filled += n;
+    printf("Filled the buffer with %zd bytes\n", filled);
+    wait_and_print(epoll_fd, "After filling");
+    if (read(reader, fill, sizeof(fill)) < 0) {
+        perror("Failed to read from device");
+    }
+    //Expect dm510-0 writable again
+    wait_and_print(epoll_fd, "After reading from a full buffer");
+    while (read(reader, fill, sizeof(fill)) > 0)
+        ;
+
+    close(epoll_fd);
+    close(reader);
+    close(writer);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "ioctl_commands.h"
+
+//How long a read may hold out for its watermark, in microseconds
+#define DELAY 100000
+
+//Milliseconds since some fixed point
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main() {
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Reads wait for 8 bytes, but no longer than DELAY
+    int lowat = 8, delay = DELAY;
+    if (ioctl(reader, SET_READ_LOWAT, &lowat) < 0 || ioctl(reader, SET_COALESCE_DELAY, &delay) < 0) {
+        fprintf(stderr, "Failed to set the read watermark: %s\n", strerror(errno));
+        close(writer);
+        close(reader);
+        return 2;
+    }
+
+    char buf[16];
+    //Half the watermark: the read should come back after about DELAY
+    write(writer, "1234", 4);
+    double start = now_ms();
+    ssize_t n = read(reader, buf, sizeof(buf));
+    printf("Read %zd bytes after %.1f ms (short of the watermark)\n", n, now_ms() - start);
+
+    //The full watermark: the read should come back right away
+    write(writer, "12345678", 8);
+    start = now_ms();
+    n = read(reader, buf, sizeof(buf));
+    printf("Read %zd bytes after %.1f ms (watermark reached)\n", n, now_ms() - start);
+
+    close(writer);
+    close(reader);
+    return 0;
+}
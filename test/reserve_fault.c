@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "ioctl_commands.h"
+
+//Bytes written in total, each read goes to exactly one of the two readers
+#define TOTAL (1 << 20)
+//Rounds of EAGAIN after the writer is done before a reader gives up
+#define IDLE_ROUNDS 1000
+
+//Reads until the buffer stays empty, adding what it got to *received. The faulting reader's
+//buffer ends in an unmapped page, so its copies stop partway and the rest of its claim goes back.
+void reader(int faulting, long long *received) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *buf = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *dst = buf;
+    if (faulting) {
+        munmap(buf + page, page);
+        dst = buf + page - 100;
+    }
+    int fd = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror("Reader failed to open /dev/dm510-1");
+        exit(1);
+    }
+    for (int idle = 0; idle < IDLE_ROUNDS;) {
+        ssize_t n = read(fd, dst, page);
+        if (n > 0) {
+            __atomic_add_fetch(received, n, __ATOMIC_RELAXED);
+            idle = 0;
+        } else {
+            idle++;
+            usleep(1000);
+        }
+    }
+    exit(0);
+}
+
+int main() {
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    //Let two readers onto dm510-1, through a descriptor that doesn't count as a reader
+    int control = open("/dev/dm510-1", O_WRONLY);
+    if (control < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+    //Two readers sharing the ring claim their bytes and copy them at the same time
+    int max_readers = 2, size = 65536;
+    if (ioctl(control, SET_MAX_NR_PROCESSES, &max_readers) < 0 || ioctl(writer, SET_BUFFER_SIZE, &size) < 0) {
+        perror("Failed to set up the devices");
+        close(control);
+        close(writer);
+        return 1;
+    }
+    long long *received = mmap(NULL, sizeof(*received), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    *received = 0;
+
+    for (int i = 0; i < 2; i++) {
+        if (fork() == 0)
+            reader(i == 0, received);
+    }
+    char chunk[4096];
+    memset(chunk, 'r', sizeof(chunk));
+    for (int sent = 0; sent < TOTAL; sent += sizeof(chunk))
+        write(writer, chunk, sizeof(chunk));
+
+    wait(NULL);
+    wait(NULL);
+    //More than was written means bytes given back by one reader went to the other again. Fewer is
+    //allowed: what a faulting reader couldn't give back, because a claim came after it, is lost.
+    printf("Wrote %d bytes, readers got %lld (%s)\n", TOTAL, *received,
+           *received > TOTAL ? "duplicated" : *received < TOTAL ? "some lost to faults" : "ok");
+
+    int one = 1;
+    size = 1024;
+    ioctl(control, SET_MAX_NR_PROCESSES, &one);
+    ioctl(writer, SET_BUFFER_SIZE, &size);
+    close(control);
+    close(writer);
+    return *received > TOTAL ? 2 : 0;
+}
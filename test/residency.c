@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "ioctl_commands.h"
+
+//How long the bytes are left in the buffer, in microseconds
+#define DELAY 50000
+
+int main() {
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Stamp the writes of dm510-0, they are timed on dm510-1 which reads them
+    int on = 1;
+    if (ioctl(writer, SET_RESIDENCY_TRACKING, &on) < 0 || ioctl(reader, RESET_LATENCY_HIST) < 0) {
+        fprintf(stderr, "Failed to turn on residency tracking: %s\n", strerror(errno));
+        close(writer);
+        close(reader);
+        return 2;
+    }
+
+    write(writer, "first", 5);
+    usleep(DELAY);
+    write(writer, "second", 6);
+    usleep(DELAY);
+
+    //The oldest byte should be about two delays old
+    unsigned long long age;
+    ioctl(reader, GET_OLDEST_AGE, &age);
+    printf("Oldest unread byte is %.1f ms old\n", age / 1000000.0);
+
+    //Reading the first write leaves the second as the oldest
+    char buf[16];
+    read(reader, buf, 5);
+    ioctl(reader, GET_OLDEST_AGE, &age);
+    printf("After reading the first write: %.1f ms old\n", age / 1000000.0);
+    read(reader, buf, 6);
+    ioctl(reader, GET_OLDEST_AGE, &age);
+    printf("After reading everything: %llu ns\n", age);
+
+    struct dm510_latency_hist hist;
+    if (ioctl(reader, GET_LATENCY_HIST, &hist) == 0) {
+        for (int i = 0; i < DM510_HIST_BUCKETS; i++) {
+            if (hist.bucket[DM510_HIST_RESIDENCY][i])
+                printf("  %llu writes waited %llu to %llu ns\n", hist.bucket[DM510_HIST_RESIDENCY][i], 1ULL << i,
+                       2ULL << i);
+        }
+    }
+
+    int off = 0;
+    ioctl(writer, SET_RESIDENCY_TRACKING, &off);
+    close(writer);
+    close(reader);
+    return 0;
+}
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+
+//Bytes pushed through while splice() and read() drain the same open file at once
+#define CONCURRENT_TOTAL (1 << 20)
+
+//Bytes and checksum of what one side of the concurrent drain got
+struct drained {
+    long long bytes;
+    long long sum;
+};
+
+//Drains the shared reader until both sides together got CONCURRENT_TOTAL bytes
+void drain(int reader, int use_splice, struct drained *mine, struct drained *both) {
+    int pipefd[2];
+    char buf[4096];
+    if (use_splice && pipe(pipefd) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    while (__atomic_load_n(&both->bytes, __ATOMIC_RELAXED) < CONCURRENT_TOTAL) {
+        ssize_t n = use_splice ? splice(reader, NULL, pipefd[1], NULL, sizeof(buf), 0) : read(reader, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                perror(use_splice ? "splice" : "read");
+                exit(1);
+            }
+            usleep(100);
+            continue;
+        }
+        if (use_splice && read(pipefd[0], buf, n) != n) {
+            perror("Failed to read back the pipe");
+            exit(1);
+        }
+        for (ssize_t i = 0; i < n; i++)
+            mine->sum += (unsigned char)buf[i];
+        mine->bytes += n;
+        __atomic_add_fetch(&both->bytes, n, __ATOMIC_RELAXED);
+    }
+}
+
+int main(int argc, char const *argv[]) {
+    //Check if a message was provided as an argument
+    if (argc <= 1) {
+        fprintf(stderr, "Usage: %s <message>\n", argv[0]);
+        return 1;
+    }
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Put the message into the buffer through the first device
+    const char *msg = argv[1];
+    ssize_t written = write(writer, msg, strlen(msg));
+    if (written < 0) {
+        perror("Failed to write to device");
+        close(writer);
+        close(reader);
+        return 2;
+    }
+
+    //Move it from the second device to stdout inside the kernel
+    fflush(stdout);
+    ssize_t sent = sendfile(STDOUT_FILENO, reader, NULL, written);
+    if (sent < 0) {
+        perror("sendfile");
+        close(writer);
+        close(reader);
+        return 3;
+    }
+    printf("\nSent %zd of %zd bytes without a user space copy\n", sent, written);
+
+    //splice() and read() on one open file at once: every byte has to come out exactly once
+    struct drained *drained = mmap(NULL, 3 * sizeof(*drained), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(drained, 0, 3 * sizeof(*drained));
+    fcntl(reader, F_SETFL, O_NONBLOCK);
+    pid_t splicer = fork();
+    if (splicer == 0) {
+        drain(reader, 1, &drained[1], &drained[0]);
+        exit(0);
+    }
+    pid_t producer = fork();
+    if (producer == 0) {
+        char chunk[4096];
+        for (int sent = 0; sent < CONCURRENT_TOTAL; sent += sizeof(chunk)) {
+            for (size_t i = 0; i < sizeof(chunk); i++)
+                chunk[i] = (sent + i) % 251;
+            for (size_t done = 0; done < sizeof(chunk);) {
+                ssize_t n = write(writer, chunk + done, sizeof(chunk) - done);
+                if (n < 0) {
+                    perror("Failed to write to device");
+                    exit(1);
+                }
+                done += n;
+            }
+        }
+        exit(0);
+    }
+    drain(reader, 0, &drained[2], &drained[0]);
+    waitpid(producer, NULL, 0);
+    waitpid(splicer, NULL, 0);
+
+    long long expected = 0;
+    for (int i = 0; i < CONCURRENT_TOTAL; i++)
+        expected += i % 251;
+    long long sum = drained[1].sum + drained[2].sum;
+    printf("Concurrent drain: splice got %lld bytes, read got %lld, checksum %s\n", drained[1].bytes,
+           drained[2].bytes, sum == expected && drained[0].bytes == CONCURRENT_TOTAL ? "ok" : "MISMATCH");
+
+    close(writer);
+    close(reader);
+    return 0;
+}
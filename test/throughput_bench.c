@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "ioctl_commands.h"
+
+//Throughput matrix over buffer size, transfer size, number of readers, blocking or not, and one
+//device pair direction or both at once. Prints one CSV line per combination. Run it with the
+//module freshly loaded and nothing else using the devices; the first argument sets the megabytes
+//sent per direction and run (default 4).
+
+static const int buffer_sizes[] = { 1024, 16384, 262144 };
+static const int transfer_sizes[] = { 64, 1024, 16384 };
+static const int reader_counts[] = { 1, 2, 4 };
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+#define MAX_READERS 4
+#define TIMEOUT 60.0  //Seconds before a run is given up on
+
+//Shared between the parent and the children of a run, one entry per direction
+struct progress {
+    long long consumed[DEVICE_COUNT];  //Bytes read so far
+    long long ops;  //Successful read() and write() calls
+};
+
+//Seconds since some fixed point
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//CPU seconds used by the children reaped so far
+double children_cpu() {
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+//Writes total bytes in transfer sized pieces, retrying on EAGAIN in non-blocking mode
+void writer(int fd, long long total, int transfer, struct progress *progress) {
+    char *buf = malloc(transfer);
+    memset(buf, 'x', transfer);
+    while (total > 0) {
+        ssize_t n = write(fd, buf, total < transfer ? total : transfer);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                sched_yield();
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        total -= n;
+        __atomic_add_fetch(&progress->ops, 1, __ATOMIC_RELAXED);
+    }
+    exit(0);
+}
+
+//Reads from the device until all readers of the direction together got total bytes
+void reader(const char *path, int flags, int direction, long long total, int transfer, struct progress *progress) {
+    int fd = open(path, flags);
+    if (fd < 0) {
+        fprintf(stderr, "Reader failed to open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    char *buf = malloc(transfer);
+    while (__atomic_load_n(&progress->consumed[direction], __ATOMIC_RELAXED) < total) {
+        ssize_t n = read(fd, buf, transfer);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                sched_yield();
+                continue;
+            }
+            perror("read");
+            exit(1);
+        }
+        __atomic_add_fetch(&progress->consumed[direction], n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&progress->ops, 1, __ATOMIC_RELAXED);
+    }
+    exit(0);
+}
+
+//Reads whatever a run left behind, so the next one starts with empty buffers
+void drain(const char *path) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return;
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    close(fd);
+}
+
+//One combination, returns 0 if it finished in time
+int run(int buffer_size, int transfer, int readers, int nonblock, int devices, long long total,
+        struct progress *progress) {
+    //Device i writes into the buffer the other device reads from
+    const char *paths[DEVICE_COUNT] = { "/dev/dm510-0", "/dev/dm510-1" };
+    int flags = nonblock ? O_NONBLOCK : 0;
+    int fds[DEVICE_COUNT];
+    pid_t pids[DEVICE_COUNT * (MAX_READERS + 1)];
+    int npids = 0, ok = 1;
+
+    //Both devices get a writer, the second one only writes when both directions run. Its
+    //descriptor is also how we let the readers of the device in.
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        fds[i] = open(paths[i], O_WRONLY | flags);
+        if (fds[i] < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", paths[i], strerror(errno));
+            exit(1);
+        }
+        int size = buffer_size, max = readers;
+        if (ioctl(fds[i], SET_BUFFER_SIZE, &size) < 0 || ioctl(fds[i], SET_MAX_NR_PROCESSES, &max) < 0) {
+            fprintf(stderr, "Failed to set up %s: %s\n", paths[i], strerror(errno));
+            exit(1);
+        }
+    }
+    memset(progress, 0, sizeof(*progress));
+
+    double cpu = children_cpu(), start = now();
+    for (int d = 0; d < devices; d++) {
+        //Readers of the other device drain what device d writes
+        for (int r = 0; r < readers; r++) {
+            pid_t pid = fork();
+            if (pid == 0)
+                reader(paths[(d + 1) % DEVICE_COUNT], O_RDONLY | flags, d, total, transfer, progress);
+            pids[npids++] = pid;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+            writer(fds[d], total, transfer, progress);
+        pids[npids++] = pid;
+    }
+
+    //Done once every direction got all its bytes; readers still blocked in read() are killed
+    for (;;) {
+        int done = 1;
+        for (int d = 0; d < devices; d++)
+            if (__atomic_load_n(&progress->consumed[d], __ATOMIC_RELAXED) < total)
+                done = 0;
+        if (done)
+            break;
+        if (now() - start > TIMEOUT) {
+            ok = 0;
+            break;
+        }
+        usleep(1000);
+    }
+    double elapsed = now() - start;
+    for (int i = 0; i < npids; i++)
+        kill(pids[i], SIGKILL);
+    for (int i = 0; i < npids; i++)
+        waitpid(pids[i], NULL, 0);
+    cpu = children_cpu() - cpu;
+
+    for (int i = 0; i < DEVICE_COUNT; i++)
+        close(fds[i]);
+    for (int i = 0; i < DEVICE_COUNT; i++)
+        drain(paths[i]);
+
+    long long bytes = 0;
+    for (int d = 0; d < devices; d++)
+        bytes += progress->consumed[d];
+    printf("%d,%d,%d,%s,%d,%lld,%.6f,%.2f,%.0f,%.6f,%s\n", buffer_size, transfer, readers,
+           nonblock ? "nonblock" : "block", devices, bytes, elapsed, bytes / elapsed / 1e6,
+           progress->ops / elapsed, cpu, ok ? "ok" : "timeout");
+    fflush(stdout);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    long long total = (argc > 1 ? atoll(argv[1]) : 4) * 1000000LL;
+    if (total <= 0) {
+        fprintf(stderr, "Usage: %s [megabytes per direction]\n", argv[0]);
+        return 1;
+    }
+    struct progress *progress = mmap(NULL, sizeof(*progress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (progress == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    int failed = 0;
+    printf("buffer_size,transfer_size,readers,mode,devices,bytes,seconds,mb_per_s,ops_per_s,cpu_seconds,status\n");
+    for (unsigned b = 0; b < COUNT(buffer_sizes); b++)
+        for (unsigned t = 0; t < COUNT(transfer_sizes); t++)
+            for (unsigned r = 0; r < COUNT(reader_counts); r++)
+                for (int nonblock = 0; nonblock <= 1; nonblock++)
+                    for (int devices = 1; devices <= DEVICE_COUNT; devices++)
+                        if (run(buffer_sizes[b], transfer_sizes[t], reader_counts[r], nonblock, devices, total, progress))
+                            failed++;
+
+    //Leave the devices the way the module starts them
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        int fd = open(i ? "/dev/dm510-1" : "/dev/dm510-0", O_WRONLY);
+        int size = 1024, max = 1;
+        if (fd >= 0) {
+            ioctl(fd, SET_BUFFER_SIZE, &size);
+            ioctl(fd, SET_MAX_NR_PROCESSES, &max);
+            close(fd);
+        }
+    }
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+int main() {
+    //Open the writing side and the reading side of the same buffer
+    int writer = open("/dev/dm510-0", O_WRONLY);
+    if (writer < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-0: %s\n", strerror(errno));
+        return 1;
+    }
+    int reader = open("/dev/dm510-1", O_RDONLY);
+    if (reader < 0) {
+        fprintf(stderr, "Failed to open /dev/dm510-1: %s\n", strerror(errno));
+        close(writer);
+        return 1;
+    }
+
+    //Push a header and a payload with a single call
+    int length = 5;
+    char payload[] = "hello";
+    struct iovec out[2] = {
+        { .iov_base = &length, .iov_len = sizeof(length) },
+        { .iov_base = payload, .iov_len = sizeof(payload) - 1 },
+    };
+    ssize_t written = writev(writer, out, 2);
+    if (written < 0) {
+        perror("writev");
+        close(writer);
+        close(reader);
+        return 2;
+    }
+    printf("Wrote %zd bytes in one call\n", written);
+
+    //Pull them apart again with a single call
+    int read_length = 0;
+    char read_payload[sizeof(payload)] = { 0 };
+    struct iovec in[2] = {
+        { .iov_base = &read_length, .iov_len = sizeof(read_length) },
+        { .iov_base = read_payload, .iov_len = sizeof(read_payload) - 1 },
+    };
+    ssize_t bytes_read = readv(reader, in, 2);
+    if (bytes_read < 0) {
+        perror("readv");
+        close(writer);
+        close(reader);
+        return 3;
+    }
+    printf("Read %zd bytes in one call: length %d, payload '%s'\n", bytes_read, read_length, read_payload);
+
+    close(writer);
+    close(reader);
+    return 0;
+}